@@ -0,0 +1,157 @@
+/* Tests for the CBOR state encoding */
+
+#include <stdint.h>
+#include "unity.h"
+#include "cbor_state.h"
+
+TEST_CASE("state encodes to the documented map", "[cbor_state]")
+{
+    // { 0: 1, 1: 234, 2: 766 }
+    static const uint8_t expected[] = { 0xA3, 0x00, 0x01, 0x01, 0x18, 0xEA, 0x02, 0x19, 0x02, 0xFE };
+    uint8_t buf[CBOR_STATE_MAX_LEN];
+
+    size_t len = cbor_state_encode(buf, sizeof(buf), 23.4f, 76.6f, 0);
+    TEST_ASSERT_EQUAL(sizeof(expected), len);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, buf, len);
+}
+
+TEST_CASE("state round trip", "[cbor_state]")
+{
+    static const struct {
+        float distance_cm;
+        float percentage;
+        int64_t timestamp_ms;
+        int32_t distance_mm;
+        int32_t percentage_tenths;
+    } cases[] = {
+        { 23.4f, 76.6f, 1735689600123, 234, 766 },
+        { 23.4f, 76.6f, 0, 234, 766 },
+        { 2.0f, 100.0f, 1, 20, 1000 },
+        { 400.0f, 0.0f, INT64_MAX, 4000, 0 },
+        { 17.16f, 82.849f, 1735689600123, 172, 828 },
+        { -1.0f, -0.56f, -1, -10, -6 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint8_t buf[CBOR_STATE_MAX_LEN];
+        cbor_state_t state;
+
+        size_t len = cbor_state_encode(buf, sizeof(buf), cases[i].distance_cm,
+                                       cases[i].percentage, cases[i].timestamp_ms);
+        TEST_ASSERT_NOT_EQUAL(0, len);
+        TEST_ASSERT_TRUE(cbor_state_decode(buf, len, &state));
+        TEST_ASSERT_EQUAL_UINT32(CBOR_STATE_VERSION, state.version);
+        TEST_ASSERT_EQUAL_INT32(cases[i].distance_mm, state.distance_mm);
+        TEST_ASSERT_EQUAL_INT32(cases[i].percentage_tenths, state.percentage_tenths);
+        TEST_ASSERT_EQUAL_INT64(cases[i].timestamp_ms, state.timestamp_ms);
+    }
+}
+
+TEST_CASE("state that does not fit is not encoded", "[cbor_state]")
+{
+    uint8_t buf[CBOR_STATE_MAX_LEN];
+
+    TEST_ASSERT_EQUAL(0, cbor_state_encode(buf, 9, 23.4f, 76.6f, 0));
+    TEST_ASSERT_EQUAL(10, cbor_state_encode(buf, 10, 23.4f, 76.6f, 0));
+}
+
+TEST_CASE("truncated or foreign data does not decode", "[cbor_state]")
+{
+    uint8_t buf[CBOR_STATE_MAX_LEN];
+    cbor_state_t state;
+
+    size_t len = cbor_state_encode(buf, sizeof(buf), 23.4f, 76.6f, 1735689600123);
+    for (size_t i = 0; i < len; i++) {
+        TEST_ASSERT_FALSE(cbor_state_decode(buf, i, &state));
+    }
+
+    // Another version, and a map without the distance
+    static const uint8_t version_2[] = { 0xA3, 0x00, 0x02, 0x01, 0x18, 0xEA, 0x02, 0x19, 0x02, 0xFE };
+    static const uint8_t no_distance[] = { 0xA2, 0x00, 0x01, 0x02, 0x19, 0x02, 0xFE };
+    TEST_ASSERT_FALSE(cbor_state_decode(version_2, sizeof(version_2), &state));
+    TEST_ASSERT_FALSE(cbor_state_decode(no_distance, sizeof(no_distance), &state));
+}
+
+TEST_CASE("unknown keys are skipped whatever their value", "[cbor_state]")
+{
+    // { 0: 1, 9: "ab", 1: 234, 10: [1, {1: 2}], 2: 766, 11: h'00', 12: 1(5) }
+    static const uint8_t data[] = {
+        0xA7,
+        0x00, 0x01,
+        0x09, 0x62, 'a', 'b',
+        0x01, 0x18, 0xEA,
+        0x0A, 0x82, 0x01, 0xA1, 0x01, 0x02,
+        0x02, 0x19, 0x02, 0xFE,
+        0x0B, 0x41, 0x00,
+        0x0C, 0xC1, 0x05,
+    };
+    cbor_state_t state;
+
+    TEST_ASSERT_TRUE(cbor_state_decode(data, sizeof(data), &state));
+    TEST_ASSERT_EQUAL_INT32(234, state.distance_mm);
+    TEST_ASSERT_EQUAL_INT32(766, state.percentage_tenths);
+    TEST_ASSERT_EQUAL_INT64(0, state.timestamp_ms);
+
+    // A string running past the end of the data
+    static const uint8_t overrun[] = { 0xA4, 0x00, 0x01, 0x09, 0x65, 'a', 'b' };
+    TEST_ASSERT_FALSE(cbor_state_decode(overrun, sizeof(overrun), &state));
+}
+
+TEST_CASE("batch round trip", "[cbor_state]")
+{
+    const reading_t readings[] = {
+        { .timestamp_us = 1735689600000000, .distance_cm = 23.4f, .percentage = 76.6f },
+        { .timestamp_us = 1735689660000999, .distance_cm = 23.5f, .percentage = 76.5f },
+        { .timestamp_us = 1735689720000000, .distance_cm = 99.9f, .percentage = 0.1f },
+    };
+    uint8_t buf[CBOR_BATCH_MAX_LEN(3)];
+    cbor_state_t states[3];
+    size_t count;
+
+    size_t len = cbor_batch_encode(buf, sizeof(buf), readings, 3);
+    TEST_ASSERT_NOT_EQUAL(0, len);
+    TEST_ASSERT_TRUE(cbor_batch_decode(buf, len, states, 3, &count));
+    TEST_ASSERT_EQUAL(3, count);
+    TEST_ASSERT_EQUAL_INT32(234, states[0].distance_mm);
+    TEST_ASSERT_EQUAL_INT32(766, states[0].percentage_tenths);
+    TEST_ASSERT_EQUAL_INT64(1735689600000, states[0].timestamp_ms);
+    // Timestamps are truncated to the millisecond
+    TEST_ASSERT_EQUAL_INT64(1735689660000, states[1].timestamp_ms);
+    TEST_ASSERT_EQUAL_INT32(999, states[2].distance_mm);
+    TEST_ASSERT_EQUAL_INT32(1, states[2].percentage_tenths);
+
+    // More readings than the caller has room for
+    TEST_ASSERT_FALSE(cbor_batch_decode(buf, len, states, 2, &count));
+}
+
+TEST_CASE("batch readings taken before the clock was set have no timestamp", "[cbor_state]")
+{
+    const reading_t readings[] = {
+        // 30 s after boot, before SNTP
+        { .timestamp_us = 30000000, .distance_cm = 23.4f, .percentage = 76.6f },
+        { .timestamp_us = 1735689600000000, .distance_cm = 23.5f, .percentage = 76.5f },
+    };
+    uint8_t buf[CBOR_BATCH_MAX_LEN(2)];
+    cbor_state_t states[2];
+    size_t count;
+
+    size_t len = cbor_batch_encode(buf, sizeof(buf), readings, 2);
+    TEST_ASSERT_NOT_EQUAL(0, len);
+    TEST_ASSERT_TRUE(cbor_batch_decode(buf, len, states, 2, &count));
+    TEST_ASSERT_EQUAL(2, count);
+    TEST_ASSERT_EQUAL_INT64(0, states[0].timestamp_ms);
+    TEST_ASSERT_EQUAL_INT32(234, states[0].distance_mm);
+    TEST_ASSERT_EQUAL_INT64(1735689600000, states[1].timestamp_ms);
+}
+
+TEST_CASE("empty batch round trip", "[cbor_state]")
+{
+    uint8_t buf[CBOR_BATCH_MAX_LEN(0)];
+    cbor_state_t state;
+    size_t count = 1;
+
+    size_t len = cbor_batch_encode(buf, sizeof(buf), NULL, 0);
+    TEST_ASSERT_EQUAL(1, len);
+    TEST_ASSERT_TRUE(cbor_batch_decode(buf, len, &state, 1, &count));
+    TEST_ASSERT_EQUAL(0, count);
+}
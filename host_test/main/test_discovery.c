@@ -0,0 +1,112 @@
+/* Tests for the Home Assistant discovery payloads
+ *
+ * Built with CONFIG_MQTT_CLIENT_ID "salt_test" and CONFIG_HA_EXPIRE_AFTER_SEC 3600
+ * (see CMakeLists.txt).
+ */
+
+#include <string.h>
+#include "unity.h"
+#include "discovery.h"
+
+#define MAX_LEN DISCOVERY_JSON_MAX_LEN(sizeof(CONFIG_MQTT_CLIENT_ID))
+
+static const char s_distance[] =
+    "{\"name\":\"Salt Level Distance\","
+    "\"state_topic\":\"homeassistant/sensor/salt_test/state\","
+    "\"availability_topic\":\"homeassistant/sensor/salt_test/availability\","
+    "\"expire_after\":3600,"
+    "\"unit_of_measurement\":\"cm\","
+    "\"value_template\":\"{{ value_json.distance }}\","
+    "\"unique_id\":\"salt_test_distance\","
+    "\"device\":{\"identifiers\":[\"salt_test\"],"
+    "\"name\":\"Water Softener Salt Level\","
+    "\"model\":\"ESP32 HC-SR04\","
+    "\"manufacturer\":\"DIY\"}}";
+
+static const char s_percentage[] =
+    "{\"name\":\"Salt Level Percentage\","
+    "\"state_topic\":\"homeassistant/sensor/salt_test/state\","
+    "\"availability_topic\":\"homeassistant/sensor/salt_test/availability\","
+    "\"expire_after\":3600,"
+    "\"unit_of_measurement\":\"%\","
+    "\"value_template\":\"{{ value_json.percentage }}\","
+    "\"unique_id\":\"salt_test_percentage\","
+    "\"device\":{\"identifiers\":[\"salt_test\"]}}";
+
+TEST_CASE("distance discovery payload", "[discovery]")
+{
+    char buf[MAX_LEN];
+
+    size_t len = discovery_encode(buf, sizeof(buf), DISCOVERY_DISTANCE, CONFIG_MQTT_CLIENT_ID);
+    TEST_ASSERT_EQUAL(sizeof(s_distance) - 1, len);
+    TEST_ASSERT_EQUAL_MEMORY(s_distance, buf, len);
+}
+
+TEST_CASE("percentage discovery payload", "[discovery]")
+{
+    char buf[MAX_LEN];
+
+    size_t len = discovery_encode(buf, sizeof(buf), DISCOVERY_PERCENTAGE, CONFIG_MQTT_CLIENT_ID);
+    TEST_ASSERT_EQUAL(sizeof(s_percentage) - 1, len);
+    TEST_ASSERT_EQUAL_MEMORY(s_percentage, buf, len);
+}
+
+TEST_CASE("run-time payloads match the firmware's compile-time ones", "[discovery]")
+{
+    static const struct {
+        discovery_entity_t entity;
+        const char *payload;
+        size_t len;
+    } cases[] = {
+        { DISCOVERY_DISTANCE, DISTANCE_DISCOVERY_PAYLOAD,
+          sizeof(DISTANCE_DISCOVERY_PAYLOAD) - 1 },
+        { DISCOVERY_PERCENTAGE, PERCENTAGE_DISCOVERY_PAYLOAD,
+          sizeof(PERCENTAGE_DISCOVERY_PAYLOAD) - 1 },
+    };
+    char buf[MAX_LEN];
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t len = discovery_encode(buf, sizeof(buf), cases[i].entity, CONFIG_MQTT_CLIENT_ID);
+        TEST_ASSERT_EQUAL(cases[i].len, len);
+        TEST_ASSERT_EQUAL_MEMORY(cases[i].payload, buf, len);
+    }
+}
+
+TEST_CASE("discovery payloads follow the client ID", "[discovery]")
+{
+    char buf[DISCOVERY_JSON_MAX_LEN(sizeof("salt_test_0042"))];
+
+    // As the fleet simulator sends them for its virtual devices
+    size_t len = discovery_encode(buf, sizeof(buf), DISCOVERY_PERCENTAGE, "salt_test_0042");
+    TEST_ASSERT_EQUAL_STRING(
+        "{\"name\":\"Salt Level Percentage\","
+        "\"state_topic\":\"homeassistant/sensor/salt_test_0042/state\","
+        "\"availability_topic\":\"homeassistant/sensor/salt_test_0042/availability\","
+        "\"expire_after\":3600,"
+        "\"unit_of_measurement\":\"%\","
+        "\"value_template\":\"{{ value_json.percentage }}\","
+        "\"unique_id\":\"salt_test_0042_percentage\","
+        "\"device\":{\"identifiers\":[\"salt_test_0042\"]}}", buf);
+    TEST_ASSERT_EQUAL(strlen(buf), len);
+}
+
+TEST_CASE("DISCOVERY_JSON_MAX_LEN fits a long client ID", "[discovery]")
+{
+    static const char id[] = "a_client_id_of_sixty_four_characters_which_is_longer_than_usual_";
+    char buf[DISCOVERY_JSON_MAX_LEN(sizeof(id))];
+
+    for (int i = 0; i < DISCOVERY_ENTITY_COUNT; i++) {
+        TEST_ASSERT_NOT_EQUAL(0, discovery_encode(buf, sizeof(buf), i, id));
+    }
+}
+
+TEST_CASE("discovery payload that does not fit is not encoded", "[discovery]")
+{
+    char buf[MAX_LEN];
+
+    TEST_ASSERT_EQUAL(0, discovery_encode(buf, sizeof(s_distance) - 1, DISCOVERY_DISTANCE,
+                                          CONFIG_MQTT_CLIENT_ID));
+    TEST_ASSERT_EQUAL(sizeof(s_distance) - 1,
+                      discovery_encode(buf, sizeof(s_distance), DISCOVERY_DISTANCE,
+                                       CONFIG_MQTT_CLIENT_ID));
+}
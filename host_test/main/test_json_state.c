@@ -0,0 +1,59 @@
+/* Tests for the JSON state payload */
+
+#include "unity.h"
+#include "json_state.h"
+
+static const reading_t s_reading = {
+    .timestamp_us = 1735689600000000,
+    .distance_cm = 23.4f,
+    .percentage = 76.6f,
+};
+
+TEST_CASE("state carries the timestamp once the clock is set", "[json_state]")
+{
+    char buf[JSON_STATE_MAX_LEN];
+    const char expected[] = "{\"distance\":23.4,\"percentage\":76.6,\"timestamp_us\":1735689600000000}";
+
+    TEST_ASSERT_EQUAL(sizeof(expected) - 1, json_state_encode(buf, sizeof(buf), &s_reading));
+    TEST_ASSERT_EQUAL_STRING(expected, buf);
+}
+
+TEST_CASE("state leaves the timestamp out before the clock is set", "[json_state]")
+{
+    char buf[JSON_STATE_MAX_LEN];
+    const char expected[] = "{\"distance\":23.4,\"percentage\":76.6}";
+    // 30 s after boot, before SNTP
+    const reading_t reading = { .timestamp_us = 30000000, .distance_cm = 23.4f, .percentage = 76.6f };
+
+    TEST_ASSERT_EQUAL(sizeof(expected) - 1, json_state_encode(buf, sizeof(buf), &reading));
+    TEST_ASSERT_EQUAL_STRING(expected, buf);
+}
+
+TEST_CASE("state rounds to one decimal", "[json_state]")
+{
+    char buf[JSON_STATE_MAX_LEN];
+    const reading_t reading = { .distance_cm = 17.16f, .percentage = 82.849f };
+
+    TEST_ASSERT_NOT_EQUAL(0, json_state_encode(buf, sizeof(buf), &reading));
+    TEST_ASSERT_EQUAL_STRING("{\"distance\":17.2,\"percentage\":82.8}", buf);
+}
+
+TEST_CASE("worst-case state fits JSON_STATE_MAX_LEN", "[json_state]")
+{
+    char buf[JSON_STATE_MAX_LEN];
+    const reading_t reading = {
+        .timestamp_us = INT64_MAX,
+        .distance_cm = -400.0f,
+        .percentage = -100.0f,
+    };
+
+    TEST_ASSERT_NOT_EQUAL(0, json_state_encode(buf, sizeof(buf), &reading));
+}
+
+TEST_CASE("state that does not fit is not encoded", "[json_state]")
+{
+    char buf[JSON_STATE_MAX_LEN];
+
+    TEST_ASSERT_EQUAL(0, json_state_encode(buf, 40, &s_reading));
+    TEST_ASSERT_EQUAL(0, json_state_encode(buf, 0, &s_reading));
+}
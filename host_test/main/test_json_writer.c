@@ -0,0 +1,102 @@
+/* Tests for the JSON writer */
+
+#include <stdint.h>
+#include "unity.h"
+#include "json_writer.h"
+
+static char s_buf[64];
+
+static json_writer_t writer(size_t size)
+{
+    json_writer_t w;
+    json_writer_init(&w, s_buf, size);
+    return w;
+}
+
+TEST_CASE("fixed-point values keep their decimals", "[json_writer]")
+{
+    static const struct {
+        int64_t value;
+        unsigned decimals;
+        const char *expected;
+    } cases[] = {
+        { 435, 1, "43.5" },
+        { -10, 1, "-1.0" },
+        { 0, 1, "0.0" },
+        { 5, 2, "0.05" },
+        { -5, 2, "-0.05" },
+        { 100, 2, "1.00" },
+        { 42, 0, "42" },
+        { -7, 0, "-7" },
+        { 1234567, 3, "1234.567" },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        json_writer_t w = writer(sizeof(s_buf));
+        json_write_fixed(&w, cases[i].value, cases[i].decimals);
+        TEST_ASSERT_EQUAL_STRING(cases[i].expected, json_writer_finish(&w));
+    }
+}
+
+TEST_CASE("integers cover the whole int64 range", "[json_writer]")
+{
+    json_writer_t w = writer(sizeof(s_buf));
+
+    json_write_int(&w, INT64_MIN);
+    json_write_literal(&w, ",");
+    json_write_int(&w, INT64_MAX);
+    json_write_literal(&w, ",");
+    json_write_int(&w, 0);
+    TEST_ASSERT_EQUAL_STRING("-9223372036854775808,9223372036854775807,0",
+                             json_writer_finish(&w));
+}
+
+TEST_CASE("floats are rounded to one decimal", "[json_writer]")
+{
+    json_writer_t w = writer(sizeof(s_buf));
+
+    json_write_float1(&w, 23.44f);
+    json_write_literal(&w, ",");
+    json_write_float1(&w, 23.46f);
+    json_write_literal(&w, ",");
+    json_write_float1(&w, -0.04f);
+    json_write_literal(&w, ",");
+    json_write_float1(&w, -1.26f);
+    TEST_ASSERT_EQUAL_STRING("23.4,23.5,0.0,-1.3", json_writer_finish(&w));
+}
+
+TEST_CASE("strings are quoted and escaped", "[json_writer]")
+{
+    json_writer_t w = writer(sizeof(s_buf));
+
+    json_write_string(&w, "a\"b\\c\n\x01");
+    TEST_ASSERT_EQUAL_STRING("\"a\\\"b\\\\c\\u000a\\u0001\"", json_writer_finish(&w));
+}
+
+TEST_CASE("output that fills the buffer exactly still gets its terminator", "[json_writer]")
+{
+    json_writer_t w = writer(5);
+
+    json_write_literal(&w, "abcd");
+    TEST_ASSERT_EQUAL_STRING("abcd", json_writer_finish(&w));
+    TEST_ASSERT_EQUAL(4, w.len);
+}
+
+TEST_CASE("truncated output is reported and stays truncated", "[json_writer]")
+{
+    json_writer_t w = writer(5);
+
+    json_write_literal(&w, "abcde");
+    TEST_ASSERT_NULL(json_writer_finish(&w));
+
+    // Overflow is sticky: a later write that would fit is dropped too
+    w = writer(5);
+    json_write_literal(&w, "abc");
+    json_write_int(&w, 12345);
+    json_write_literal(&w, "d");
+    TEST_ASSERT_EQUAL(3, w.len);
+    TEST_ASSERT_NULL(json_writer_finish(&w));
+
+    w = writer(0);
+    TEST_ASSERT_NULL(json_writer_finish(&w));
+}
@@ -0,0 +1,12 @@
+/* Host unit test runner */
+
+#include <stdlib.h>
+#include "unity.h"
+
+void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    // A non-zero exit status lets scripts and CI see failures
+    exit(UNITY_END() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,86 @@
+/* Tests for the ranging math */
+
+#include <stddef.h>
+#include "unity.h"
+#include "hal.h"
+#include "ranging.h"
+
+TEST_CASE("distance is half the echo's flight at 343 m/s", "[ranging]")
+{
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 17.15f, ranging_distance_cm(1000, true));
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 34.3f, ranging_distance_cm(2000, false));
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 171.5f, ranging_distance_cm(10000, false));
+}
+
+TEST_CASE("distance outside the 2-400 cm window is -1", "[ranging]")
+{
+    // 116 us is 1.99 cm and 117 us 2.01 cm
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(116, false));
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 2.00655f, ranging_distance_cm(117, false));
+
+    // 23323 us is 399.99 cm and 23324 us 400.01 cm
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, 399.99f, ranging_distance_cm(23323, false));
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(23324, false));
+
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(0, false));
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(100000, false));
+}
+
+TEST_CASE("a missing echo is -1", "[ranging]")
+{
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(ECHO_NO_START, true));
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(ECHO_NO_END, true));
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(ECHO_NO_START, false));
+    TEST_ASSERT_EQUAL_FLOAT(-1.0f, ranging_distance_cm(ECHO_NO_END, false));
+}
+
+TEST_CASE("percentage is linear over the tank height", "[ranging]")
+{
+    const settings_t settings = { .reading_interval_sec = 60, .tank_height_cm = 100 };
+
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, ranging_percentage(100.0f, &settings));
+    TEST_ASSERT_EQUAL_FLOAT(100.0f, ranging_percentage(0.0f, &settings));
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 50.0f, ranging_percentage(50.0f, &settings));
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 76.6f, ranging_percentage(23.4f, &settings));
+}
+
+TEST_CASE("percentage is clamped to 0-100", "[ranging]")
+{
+    const settings_t settings = { .reading_interval_sec = 60, .tank_height_cm = 100 };
+
+    // Deeper than the tank, e.g. an echo off the floor past a tilted sensor
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, ranging_percentage(150.0f, &settings));
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, ranging_percentage(400.0f, &settings));
+}
+
+TEST_CASE("a failed echo gives no reading to publish", "[ranging]")
+{
+    const settings_t settings = { .reading_interval_sec = 60, .tank_height_cm = 100 };
+    // No echo at all, an echo that never ended, and echoes outside the 2-400 cm window
+    const int64_t echoes[] = { ECHO_NO_START, ECHO_NO_END, 0, 116, 23324, 100000 };
+
+    for (size_t i = 0; i < sizeof(echoes) / sizeof(echoes[0]); i++) {
+        reading_t reading;
+
+        TEST_ASSERT_FALSE(ranging_make_reading(echoes[i], 1735689600000000, &settings, false,
+                                               &reading));
+        TEST_ASSERT_EQUAL_FLOAT(-1.0f, reading.distance_cm);
+        // Before the fix, -1 cm was clamped to a full tank
+        TEST_ASSERT_EQUAL_FLOAT(0.0f, reading.percentage);
+    }
+}
+
+TEST_CASE("a good echo gives a reading to publish", "[ranging]")
+{
+    const settings_t settings = { .reading_interval_sec = 60, .tank_height_cm = 100 };
+    reading_t reading;
+
+    TEST_ASSERT_TRUE(ranging_make_reading(1000, 1735689600000000, &settings, true, &reading));
+    TEST_ASSERT_EQUAL_INT64(1735689600000000, reading.timestamp_us);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 17.15f, reading.distance_cm);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 82.85f, reading.percentage);
+
+    // The far end of the window is still a reading, of an empty tank
+    TEST_ASSERT_TRUE(ranging_make_reading(23323, 1735689600000000, &settings, false, &reading));
+    TEST_ASSERT_EQUAL_FLOAT(0.0f, reading.percentage);
+}
@@ -0,0 +1,87 @@
+/* Batching of timestamped readings */
+
+#include "sdkconfig.h"
+#include "json_writer.h"
+#include "time_sync.h"
+#include "batch.h"
+
+static reading_t s_readings[CONFIG_BATCH_MAX_READINGS];
+static size_t s_count = 0;
+
+/* Level at the last flush, used to detect a significant change */
+static float s_reference_percentage = 0;
+static bool s_have_reference = false;
+
+bool batch_add(const reading_t *reading)
+{
+    // The caller flushes as soon as the batch is full, so there is always room
+    if (s_count < CONFIG_BATCH_MAX_READINGS) {
+        s_readings[s_count++] = *reading;
+    }
+
+    if (!s_have_reference) {
+        s_reference_percentage = reading->percentage;
+        s_have_reference = true;
+    }
+
+    if (s_count >= CONFIG_BATCH_MAX_READINGS) {
+        return true;
+    }
+
+    int64_t age_us = reading->timestamp_us - s_readings[0].timestamp_us;
+    if (age_us >= (int64_t)CONFIG_BATCH_MAX_AGE_SEC * 1000000) {
+        return true;
+    }
+
+#if CONFIG_BATCH_CHANGE_THRESHOLD > 0
+    float change = reading->percentage - s_reference_percentage;
+    if (change >= CONFIG_BATCH_CHANGE_THRESHOLD || change <= -CONFIG_BATCH_CHANGE_THRESHOLD) {
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+size_t batch_count(void)
+{
+    return s_count;
+}
+
+const reading_t *batch_readings(void)
+{
+    return s_readings;
+}
+
+void batch_clear(void)
+{
+    if (s_count > 0) {
+        s_reference_percentage = s_readings[s_count - 1].percentage;
+    }
+    s_count = 0;
+}
+
+size_t batch_encode_json(char *buf, size_t size)
+{
+    json_writer_t w;
+
+    json_writer_init(&w, buf, size);
+    json_write_literal(&w, "[");
+    for (size_t i = 0; i < s_count; i++) {
+        if (i > 0) {
+            json_write_literal(&w, ",");
+        }
+        json_write_literal(&w, "[");
+        // 0 for a reading taken before the clock was set
+        json_write_int(&w, time_sync_timestamp_valid(s_readings[i].timestamp_us) ?
+                           s_readings[i].timestamp_us / 1000 : 0);
+        json_write_literal(&w, ",");
+        json_write_float1(&w, s_readings[i].distance_cm);
+        json_write_literal(&w, ",");
+        json_write_float1(&w, s_readings[i].percentage);
+        json_write_literal(&w, "]");
+    }
+    json_write_literal(&w, "]");
+
+    return json_writer_finish(&w) != NULL ? w.len : 0;
+}
@@ -0,0 +1,34 @@
+/* Batching of timestamped readings
+ *
+ * Instead of one MQTT message per reading, readings are collected and published
+ * together on the batch topic, amortizing the per-publish TCP and broker cost.
+ * Only used from the publish task, so there is no locking.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "reading.h"
+
+/* Worst-case size of a JSON batch: "[" + one "[ts,distance,percentage]," per reading + "]" */
+#define BATCH_JSON_MAX_LEN (2 + CONFIG_BATCH_MAX_READINGS * 48)
+
+/* Add a reading. Returns true when the batch should be flushed now: it is full,
+ * its oldest reading is older than CONFIG_BATCH_MAX_AGE_SEC, or the level moved by
+ * at least CONFIG_BATCH_CHANGE_THRESHOLD percent since the last flush. */
+bool batch_add(const reading_t *reading);
+
+size_t batch_count(void);
+
+/* Readings in capture order; valid until the next batch_add() or batch_clear() */
+const reading_t *batch_readings(void);
+
+/* Empty the batch after it has been published (or handed elsewhere) */
+void batch_clear(void);
+
+/* Encode as a JSON array of [timestamp_ms, distance, percentage] triples, with a
+ * timestamp of 0 for readings taken before the clock was set.
+ * Returns the payload length, or 0 if it did not fit. */
+size_t batch_encode_json(char *buf, size_t size);
@@ -0,0 +1,224 @@
+/* Reading cycle benchmark */
+
+#include <inttypes.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <time.h>
+#else
+#include "esp_cpu.h"
+#endif
+#include "bench.h"
+
+static const char *TAG = "BENCH";
+
+#if CONFIG_IDF_TARGET_LINUX
+#define UNIT "ns"
+#else
+#define UNIT "cycles"
+#endif
+
+/* Largest samples kept per stage: enough for an exact p99 over the burst even
+ * with two samples per reading */
+#define TOP_LEN ((2 * CONFIG_BENCHMARK_ITERATIONS) / 100 + 1)
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t top[TOP_LEN];      // Min-heap of the largest samples
+    size_t top_len;
+} stage_stats_t;
+
+static const char *const s_stage_names[BENCH_STAGE_COUNT] = {
+    [BENCH_TRIGGER] = "trigger",
+    [BENCH_ECHO_WAIT] = "echo_wait",
+    [BENCH_ECHO_PULSE] = "echo_pulse",
+    [BENCH_CONVERT] = "convert",
+    [BENCH_HANDOFF] = "handoff",
+    [BENCH_SERIALIZE] = "serialize",
+    [BENCH_ENQUEUE] = "enqueue",
+    [BENCH_BATCH_SERIALIZE] = "batch_serialize",
+    [BENCH_BATCH_ENQUEUE] = "batch_enqueue",
+};
+
+/* Each stage is only ever recorded by one task, and only read once the
+ * measurement has ended, so the statistics need no lock */
+static stage_stats_t s_stats[BENCH_STAGE_COUNT];
+static uint32_t s_sorted[TOP_LEN];              // Report scratch space
+static atomic_bool s_running;
+static atomic_bool s_finished;
+static int64_t s_start_us = 0;
+static int64_t s_elapsed_us = 0;
+
+uint32_t bench_now(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#else
+    return esp_cpu_get_cycle_count();
+#endif
+}
+
+/* Keep value if it is among the TOP_LEN largest so far */
+static void keep_if_top(stage_stats_t *st, uint32_t value)
+{
+    size_t i;
+
+    if (st->top_len < TOP_LEN) {
+        // Sift up from the new leaf
+        i = st->top_len++;
+        while (i > 0 && st->top[(i - 1) / 2] > value) {
+            st->top[i] = st->top[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        st->top[i] = value;
+        return;
+    }
+    if (value <= st->top[0]) {
+        return;
+    }
+
+    // Replace the smallest kept sample and sift down
+    i = 0;
+    while (2 * i + 1 < TOP_LEN) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < TOP_LEN && st->top[child + 1] < st->top[child]) {
+            child++;
+        }
+        if (value <= st->top[child]) {
+            break;
+        }
+        st->top[i] = st->top[child];
+        i = child;
+    }
+    st->top[i] = value;
+}
+
+uint32_t bench_record(bench_stage_t stage, uint32_t start)
+{
+    if (!atomic_load_explicit(&s_running, memory_order_relaxed)) {
+        return bench_now();
+    }
+
+    // Unsigned difference, correct across a wrap of the counter (every ~18 s at 240 MHz)
+    uint32_t value = bench_now() - start;
+    stage_stats_t *st = &s_stats[stage];
+
+    if (st->count == 0 || value < st->min) {
+        st->min = value;
+    }
+    if (value > st->max) {
+        st->max = value;
+    }
+    st->count++;
+    st->sum += value;
+    keep_if_top(st, value);
+
+    // Taken after the bookkeeping so it is not charged to the next stage
+    return bench_now();
+}
+
+void bench_start(void)
+{
+    memset(s_stats, 0, sizeof(s_stats));
+    atomic_store(&s_finished, false);
+    s_start_us = esp_timer_get_time();
+    atomic_store(&s_running, true);
+}
+
+void bench_finish(void)
+{
+    s_elapsed_us = esp_timer_get_time() - s_start_us;
+    // Release: the sensor task's samples are complete before the report is due
+    atomic_store_explicit(&s_finished, true, memory_order_release);
+}
+
+bool bench_report_due(void)
+{
+    if (!atomic_exchange_explicit(&s_finished, false, memory_order_acquire)) {
+        return false;
+    }
+    atomic_store(&s_running, false);
+    return true;
+}
+
+/* Nearest-rank 99th percentile: the k-th largest sample, k = count - ceil(0.99 count) + 1 */
+static uint32_t percentile_99(const stage_stats_t *st)
+{
+    size_t k = st->count - (99 * (uint64_t)st->count + 99) / 100 + 1;
+
+    // Only if a stage saw more samples than expected; the result is then an upper bound
+    if (k > st->top_len) {
+        k = st->top_len;
+    }
+
+    // Insertion sort, largest first; at most TOP_LEN samples
+    for (size_t i = 0; i < st->top_len; i++) {
+        uint32_t value = st->top[i];
+        size_t j = i;
+        while (j > 0 && s_sorted[j - 1] < value) {
+            s_sorted[j] = s_sorted[j - 1];
+            j--;
+        }
+        s_sorted[j] = value;
+    }
+    return s_sorted[k - 1];
+}
+
+void bench_log(void)
+{
+    ESP_LOGI(TAG, "%d readings in %" PRId64 " ms, times in " UNIT ":",
+             CONFIG_BENCHMARK_ITERATIONS, s_elapsed_us / 1000);
+    for (int i = 0; i < BENCH_STAGE_COUNT; i++) {
+        const stage_stats_t *st = &s_stats[i];
+        if (st->count == 0) {
+            ESP_LOGI(TAG, "  %-15s no samples", s_stage_names[i]);
+            continue;
+        }
+        ESP_LOGI(TAG, "  %-15s n=%" PRIu32 " min=%" PRIu32 " mean=%" PRIu32 " p99=%" PRIu32 " max=%" PRIu32, s_stage_names[i],
+                 st->count, st->min, (uint32_t)(st->sum / st->count), percentile_99(st), st->max);
+    }
+}
+
+void bench_write_json(json_writer_t *w)
+{
+    json_write_literal(w, "{\"unit\":\"" UNIT "\"");
+#if !CONFIG_IDF_TARGET_LINUX
+    json_write_literal(w, ",\"cpu_mhz\":");
+    json_write_int(w, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+#endif
+    json_write_literal(w, ",\"iterations\":");
+    json_write_int(w, CONFIG_BENCHMARK_ITERATIONS);
+    json_write_literal(w, ",\"elapsed_ms\":");
+    json_write_int(w, s_elapsed_us / 1000);
+    json_write_literal(w, ",\"stages\":{");
+
+    for (int i = 0; i < BENCH_STAGE_COUNT; i++) {
+        const stage_stats_t *st = &s_stats[i];
+
+        if (i > 0) {
+            json_write_literal(w, ",");
+        }
+        json_write_string(w, s_stage_names[i]);
+        json_write_literal(w, ":{\"count\":");
+        json_write_int(w, st->count);
+        if (st->count > 0) {
+            json_write_literal(w, ",\"min\":");
+            json_write_int(w, st->min);
+            json_write_literal(w, ",\"mean\":");
+            json_write_int(w, st->sum / st->count);
+            json_write_literal(w, ",\"p99\":");
+            json_write_int(w, percentile_99(st));
+            json_write_literal(w, ",\"max\":");
+            json_write_int(w, st->max);
+        }
+        json_write_literal(w, "}");
+    }
+    json_write_literal(w, "}}");
+}
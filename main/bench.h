@@ -0,0 +1,87 @@
+/* Reading cycle benchmark
+ *
+ * With CONFIG_BENCHMARK_ENABLE the sensor task starts with a burst of
+ * CONFIG_BENCHMARK_ITERATIONS readings, CONFIG_BENCHMARK_PERIOD_MS apart, once MQTT
+ * has connected. Every reading goes through the normal path and each stage is
+ * timed on its own. When the burst is over, min, mean, p99 and max per stage are
+ * logged and published on the benchmark topic:
+ *
+ *   {"unit":"cycles","cpu_mhz":240,"iterations":1000,"elapsed_ms":61042,
+ *    "stages":{"trigger":{"count":1000,"min":..,"mean":..,"p99":..,"max":..},..}}
+ *
+ * Stages are timed in CPU cycles (esp_cpu_get_cycle_count()) on the ESP32 and in
+ * nanoseconds on the linux target, where the simulated sensor has no trigger or
+ * echo stages. Serialization and enqueue are timed per message, so they count two
+ * samples per reading with both JSON and CBOR enabled. With CONFIG_BATCH_ENABLE the
+ * state topic is only refreshed once per batch, so those two stages see one reading
+ * per batch; the batch stages time the batch messages themselves. Without the
+ * option, the timing calls below compile to nothing.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "json_writer.h"
+
+typedef enum {
+    BENCH_TRIGGER,              // Trigger pulse
+    BENCH_ECHO_WAIT,            // End of the trigger to the echo's rising edge
+    BENCH_ECHO_PULSE,           // Echo pulse width, i.e. the time of flight
+    BENCH_CONVERT,              // Echo to distance and percentage
+    BENCH_HANDOFF,              // Sample ring push and publish task wake-up
+    BENCH_SERIALIZE,            // State payload encoding
+    BENCH_ENQUEUE,              // Handing the payload to esp-mqtt
+    BENCH_BATCH_SERIALIZE,      // Batch payload encoding
+    BENCH_BATCH_ENQUEUE,        // Handing the batch payload to esp-mqtt
+    BENCH_STAGE_COUNT,
+} bench_stage_t;
+
+/* Worst-case JSON size of a report */
+#define BENCH_JSON_MAX_LEN (128 + BENCH_STAGE_COUNT * 96)
+
+#if CONFIG_BENCHMARK_ENABLE
+
+/* Current time in the benchmark's unit */
+uint32_t bench_now(void);
+
+/* Record the time from start to now for a stage, while a burst is being measured.
+ * Returns now, so consecutive stages can be chained:
+ *
+ *   uint32_t t = bench_now();
+ *   ...
+ *   t = bench_record(BENCH_CONVERT, t);
+ *   ...
+ *   bench_record(BENCH_HANDOFF, t);
+ */
+uint32_t bench_record(bench_stage_t stage, uint32_t start);
+
+/* Clear the statistics and start measuring (sensor task, before the burst) */
+void bench_start(void);
+
+/* The burst is complete (sensor task) */
+void bench_finish(void);
+
+/* True once after bench_finish(), which also ends the measurement. Call before
+ * draining the sample ring, then report once it is drained, so that every
+ * reading of the burst is included. */
+bool bench_report_due(void);
+
+/* Log the report, one line per stage */
+void bench_log(void);
+
+void bench_write_json(json_writer_t *w);
+
+#else
+
+static inline uint32_t bench_now(void)
+{
+    return 0;
+}
+
+static inline uint32_t bench_record(bench_stage_t stage, uint32_t start)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,314 @@
+/* Compact CBOR encoding of salt level readings
+ *
+ * Only the subset of RFC 8949 needed here is implemented: definite-length arrays
+ * and maps, and signed integers. The decoder can also skip over any other
+ * definite-length item, so values of unknown keys may be of any type.
+ */
+
+#include <string.h>
+#include "time_sync.h"
+#include "cbor_state.h"
+
+#define MAJOR_UINT  0
+#define MAJOR_NINT  1
+#define MAJOR_BYTES 2
+#define MAJOR_TEXT  3
+#define MAJOR_ARRAY 4
+#define MAJOR_MAP   5
+#define MAJOR_TAG   6
+
+/* Nesting accepted inside the value of an unknown key */
+#define SKIP_MAX_DEPTH 8
+
+enum {
+    KEY_VERSION = 0,
+    KEY_DISTANCE_MM = 1,
+    KEY_PERCENTAGE_TENTHS = 2,
+    KEY_TIMESTAMP_MS = 3,
+};
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    bool overflow;
+} writer_t;
+
+typedef struct {
+    const uint8_t *buf;
+    size_t len;
+    size_t pos;
+} reader_t;
+
+/* Write an initial byte plus the shortest big-endian argument that fits */
+static void put_head(writer_t *w, uint8_t major, uint64_t value)
+{
+    uint8_t head[9];
+    size_t n;
+
+    if (value < 24) {
+        head[0] = (major << 5) | (uint8_t)value;
+        n = 1;
+    } else if (value <= 0xFF) {
+        head[0] = (major << 5) | 24;
+        n = 2;
+    } else if (value <= 0xFFFF) {
+        head[0] = (major << 5) | 25;
+        n = 3;
+    } else if (value <= 0xFFFFFFFF) {
+        head[0] = (major << 5) | 26;
+        n = 5;
+    } else {
+        head[0] = (major << 5) | 27;
+        n = 9;
+    }
+    for (size_t i = n - 1; i >= 1; i--) {
+        head[i] = (uint8_t)value;
+        value >>= 8;
+    }
+
+    if (w->overflow || w->len - w->pos < n) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->pos, head, n);
+    w->pos += n;
+}
+
+static void put_int(writer_t *w, int64_t value)
+{
+    if (value >= 0) {
+        put_head(w, MAJOR_UINT, (uint64_t)value);
+    } else {
+        put_head(w, MAJOR_NINT, (uint64_t)(-1 - value));
+    }
+}
+
+/* Round to the nearest integer number of 1/scale units */
+static int32_t to_fixed(float value, float scale)
+{
+    float scaled = value * scale;
+    return (int32_t)(scaled + (scaled >= 0 ? 0.5f : -0.5f));
+}
+
+static void put_state(writer_t *w, float distance_cm, float percentage, int64_t timestamp_ms)
+{
+    put_head(w, MAJOR_MAP, timestamp_ms != 0 ? 4 : 3);
+    put_int(w, KEY_VERSION);
+    put_int(w, CBOR_STATE_VERSION);
+    put_int(w, KEY_DISTANCE_MM);
+    put_int(w, to_fixed(distance_cm, 10.0f));
+    put_int(w, KEY_PERCENTAGE_TENTHS);
+    put_int(w, to_fixed(percentage, 10.0f));
+    if (timestamp_ms != 0) {
+        put_int(w, KEY_TIMESTAMP_MS);
+        put_int(w, timestamp_ms);
+    }
+}
+
+size_t cbor_state_encode(uint8_t *buf, size_t len, float distance_cm, float percentage,
+                         int64_t timestamp_ms)
+{
+    writer_t w = { .buf = buf, .len = len };
+
+    put_state(&w, distance_cm, percentage, timestamp_ms);
+
+    return w.overflow ? 0 : w.pos;
+}
+
+size_t cbor_batch_encode(uint8_t *buf, size_t len, const reading_t *readings, size_t count)
+{
+    writer_t w = { .buf = buf, .len = len };
+
+    put_head(&w, MAJOR_ARRAY, count);
+    for (size_t i = 0; i < count; i++) {
+        // A reading taken before the clock was set goes without a timestamp
+        put_state(&w, readings[i].distance_cm, readings[i].percentage,
+                  time_sync_timestamp_valid(readings[i].timestamp_us) ?
+                  readings[i].timestamp_us / 1000 : 0);
+    }
+
+    return w.overflow ? 0 : w.pos;
+}
+
+static bool get_head(reader_t *r, uint8_t *major, uint64_t *value)
+{
+    if (r->pos >= r->len) {
+        return false;
+    }
+
+    uint8_t initial = r->buf[r->pos++];
+    uint8_t info = initial & 0x1F;
+    *major = initial >> 5;
+
+    if (info < 24) {
+        *value = info;
+        return true;
+    }
+    // Indefinite lengths and reserved encodings are never produced by the encoder
+    if (info > 27) {
+        return false;
+    }
+
+    size_t n = (size_t)1 << (info - 24);
+    if (r->len - r->pos < n) {
+        return false;
+    }
+    *value = 0;
+    for (size_t i = 0; i < n; i++) {
+        *value = (*value << 8) | r->buf[r->pos++];
+    }
+    return true;
+}
+
+static bool get_int(reader_t *r, int64_t *value)
+{
+    uint8_t major;
+    uint64_t arg;
+
+    if (!get_head(r, &major, &arg) || arg > INT64_MAX) {
+        return false;
+    }
+    if (major == MAJOR_UINT) {
+        *value = (int64_t)arg;
+    } else if (major == MAJOR_NINT) {
+        *value = -1 - (int64_t)arg;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Skip one data item of any type, including everything nested in it */
+static bool skip_item(reader_t *r, unsigned depth)
+{
+    uint8_t major;
+    uint64_t arg;
+
+    if (depth > SKIP_MAX_DEPTH || !get_head(r, &major, &arg)) {
+        return false;
+    }
+
+    switch (major) {
+    case MAJOR_BYTES:
+    case MAJOR_TEXT:
+        if (arg > r->len - r->pos) {
+            return false;
+        }
+        r->pos += (size_t)arg;
+        return true;
+    case MAJOR_ARRAY:
+    case MAJOR_MAP:
+        // Every item takes at least one byte, which also bounds the loop
+        if (arg > r->len - r->pos) {
+            return false;
+        }
+        for (uint64_t i = 0; i < (major == MAJOR_MAP ? 2 * arg : arg); i++) {
+            if (!skip_item(r, depth + 1)) {
+                return false;
+            }
+        }
+        return true;
+    case MAJOR_TAG:
+        return skip_item(r, depth + 1);
+    default:
+        // Integers, simple values and floats are complete after the head
+        return true;
+    }
+}
+
+static bool fits_int32(int64_t value)
+{
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+/* Read one state map */
+static bool get_state(reader_t *r, cbor_state_t *state)
+{
+    uint8_t major;
+    uint64_t count;
+
+    if (!get_head(r, &major, &count) || major != MAJOR_MAP || count > 16) {
+        return false;
+    }
+
+    bool have_version = false;
+    bool have_distance = false;
+    bool have_percentage = false;
+    *state = (cbor_state_t) { 0 };
+
+    for (uint64_t i = 0; i < count; i++) {
+        int64_t key;
+        int64_t value;
+
+        if (!get_int(r, &key)) {
+            return false;
+        }
+        if (key < KEY_VERSION || key > KEY_TIMESTAMP_MS) {
+            // Field added by a newer encoder; ignore it, whatever its type
+            if (!skip_item(r, 0)) {
+                return false;
+            }
+            continue;
+        }
+        if (!get_int(r, &value)) {
+            return false;
+        }
+
+        switch (key) {
+        case KEY_VERSION:
+            if (value != CBOR_STATE_VERSION) {
+                return false;
+            }
+            state->version = (uint32_t)value;
+            have_version = true;
+            break;
+        case KEY_DISTANCE_MM:
+            if (!fits_int32(value)) {
+                return false;
+            }
+            state->distance_mm = (int32_t)value;
+            have_distance = true;
+            break;
+        case KEY_PERCENTAGE_TENTHS:
+            if (!fits_int32(value)) {
+                return false;
+            }
+            state->percentage_tenths = (int32_t)value;
+            have_percentage = true;
+            break;
+        case KEY_TIMESTAMP_MS:
+            state->timestamp_ms = value;
+            break;
+        }
+    }
+
+    return have_version && have_distance && have_percentage;
+}
+
+bool cbor_state_decode(const uint8_t *buf, size_t len, cbor_state_t *state)
+{
+    reader_t r = { .buf = buf, .len = len };
+
+    return get_state(&r, state) && r.pos == r.len;
+}
+
+bool cbor_batch_decode(const uint8_t *buf, size_t len, cbor_state_t *states, size_t max,
+                       size_t *count)
+{
+    reader_t r = { .buf = buf, .len = len };
+    uint8_t major;
+    uint64_t n;
+
+    if (!get_head(&r, &major, &n) || major != MAJOR_ARRAY || n > max) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!get_state(&r, &states[i])) {
+            return false;
+        }
+    }
+
+    *count = (size_t)n;
+    return r.pos == r.len;
+}
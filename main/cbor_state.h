@@ -0,0 +1,55 @@
+/* Compact CBOR encoding of salt level readings
+ *
+ * A reading is a CBOR map with small integer keys and fixed-point integer values,
+ * which typically encodes in 11 bytes versus ~35 for the JSON state payload and
+ * needs no float formatting:
+ *
+ *   { 0: version, 1: distance in mm, 2: percentage in tenths, [3: Unix time in ms] }
+ *
+ * A batch is a CBOR array of such maps, each with its timestamp. Unknown integer
+ * keys are skipped by the decoder whatever the type of their value (indefinite
+ * lengths aside), so fields can be added without bumping CBOR_STATE_VERSION.
+ * The module is plain C with no ESP-IDF dependencies so it also builds for the
+ * Linux host target.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "reading.h"
+
+#define CBOR_STATE_VERSION 1
+
+/* Worst-case encoded size of one reading */
+#define CBOR_STATE_MAX_LEN 32
+
+/* Worst-case encoded size of a batch of n readings */
+#define CBOR_BATCH_MAX_LEN(n) (9 + (n) * CBOR_STATE_MAX_LEN)
+
+typedef struct {
+    uint32_t version;
+    int32_t distance_mm;
+    int32_t percentage_tenths;
+    int64_t timestamp_ms;       // 0 when the reading carries no timestamp
+} cbor_state_t;
+
+/* Encode a reading. timestamp_ms of 0 omits the timestamp field.
+ * Returns the number of bytes written, or 0 if buf is too small. */
+size_t cbor_state_encode(uint8_t *buf, size_t len, float distance_cm, float percentage,
+                         int64_t timestamp_ms);
+
+/* Decode a reading produced by cbor_state_encode().
+ * Returns false if the data is malformed or not a state map. */
+bool cbor_state_decode(const uint8_t *buf, size_t len, cbor_state_t *state);
+
+/* Encode readings as an array of state maps with millisecond timestamps, left out
+ * for readings taken before the clock was set.
+ * Returns the number of bytes written, or 0 if buf is too small. */
+size_t cbor_batch_encode(uint8_t *buf, size_t len, const reading_t *readings, size_t count);
+
+/* Decode a batch of at most max readings into states[].
+ * Returns false if the data is malformed or holds more than max readings. */
+bool cbor_batch_decode(const uint8_t *buf, size_t len, cbor_state_t *states, size_t max,
+                       size_t *count);
@@ -0,0 +1,74 @@
+/* Memory and CPU diagnostics */
+
+#include <string.h>
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "diagnostics.h"
+
+/* Task snapshot and each task's run-time counter at the previous snapshot, matched
+ * by task number since handles can be reused after a task is deleted. Static
+ * because a snapshot is too large for the caller's stack. */
+static TaskStatus_t s_status[DIAGNOSTICS_MAX_TASKS];
+static UBaseType_t s_prev_number[DIAGNOSTICS_MAX_TASKS];
+static uint32_t s_prev_counter[DIAGNOSTICS_MAX_TASKS];
+static size_t s_prev_count = 0;
+static uint32_t s_prev_total = 0;
+
+static uint32_t prev_counter(UBaseType_t number)
+{
+    for (size_t i = 0; i < s_prev_count; i++) {
+        if (s_prev_number[i] == number) {
+            return s_prev_counter[i];
+        }
+    }
+    return 0;
+}
+
+void diagnostics_write_json(json_writer_t *w)
+{
+    uint32_t total = 0;
+    // Reports no tasks at all if there are more than DIAGNOSTICS_MAX_TASKS
+    UBaseType_t count = uxTaskGetSystemState(s_status, DIAGNOSTICS_MAX_TASKS, &total);
+
+    json_write_literal(w, "{\"uptime_s\":");
+    json_write_int(w, esp_timer_get_time() / 1000000);
+    json_write_literal(w, ",\"heap\":{\"free\":");
+    json_write_int(w, esp_get_free_heap_size());
+    json_write_literal(w, ",\"min_free\":");
+    json_write_int(w, esp_get_minimum_free_heap_size());
+    json_write_literal(w, ",\"largest_block\":");
+    json_write_int(w, heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+    json_write_literal(w, "},\"tasks\":[");
+
+    // The counters are 32-bit microseconds and wrap after about 71 minutes; unsigned
+    // differences stay correct as long as snapshots are closer together than that
+    uint64_t elapsed = (uint64_t)(uint32_t)(total - s_prev_total) * portNUM_PROCESSORS;
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        const TaskStatus_t *task = &s_status[i];
+        uint32_t busy = task->ulRunTimeCounter - prev_counter(task->xTaskNumber);
+
+        if (i > 0) {
+            json_write_literal(w, ",");
+        }
+        json_write_literal(w, "{\"name\":");
+        json_write_string(w, task->pcTaskName);
+        json_write_literal(w, ",\"stack_free\":");
+        json_write_int(w, task->usStackHighWaterMark);
+        json_write_literal(w, ",\"cpu\":");
+        // Tenths of a percent
+        json_write_fixed(w, elapsed > 0 ? (int64_t)((uint64_t)busy * 1000 / elapsed) : 0, 1);
+        json_write_literal(w, "}");
+    }
+    json_write_literal(w, "]}");
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        s_prev_number[i] = s_status[i].xTaskNumber;
+        s_prev_counter[i] = s_status[i].ulRunTimeCounter;
+    }
+    s_prev_count = count;
+    s_prev_total = total;
+}
@@ -0,0 +1,27 @@
+/* Memory and CPU diagnostics
+ *
+ * A snapshot of every FreeRTOS task's stack high-water mark and CPU share, plus
+ * free, minimum-ever free and largest free block of the heap, published on the
+ * diagnostics topic every CONFIG_DIAGNOSTICS_INTERVAL_SEC:
+ *
+ *   {"uptime_s":..,"heap":{"free":..,"min_free":..,"largest_block":..},
+ *    "tasks":[{"name":"sensor_task","stack_free":..,"cpu":..},..]}
+ *
+ * "cpu" is the task's share of all cores in percent since the previous snapshot,
+ * from the FreeRTOS run-time statistics. Collecting a snapshot walks the task list
+ * once with the scheduler briefly suspended, so a slow cadence costs next to nothing.
+ */
+
+#pragma once
+
+#include "json_writer.h"
+
+/* Upper bound on tasks in one snapshot; ESP-IDF with Wi-Fi runs about 20 */
+#define DIAGNOSTICS_MAX_TASKS 28
+
+/* Worst-case JSON size of a snapshot */
+#define DIAGNOSTICS_JSON_MAX_LEN (128 + DIAGNOSTICS_MAX_TASKS * 64)
+
+/* Take a snapshot and write it as JSON. Not thread-safe: the CPU shares are
+ * relative to the previous call, so call from one task only. */
+void diagnostics_write_json(json_writer_t *w);
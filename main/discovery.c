@@ -0,0 +1,54 @@
+/* Home Assistant MQTT discovery payloads */
+
+#include <string.h>
+#include "json_writer.h"
+#include "topics.h"
+#include "discovery.h"
+
+size_t discovery_encode(char *buf, size_t size, discovery_entity_t entity, const char *client_id)
+{
+    size_t id_len = strlen(client_id);
+    json_writer_t w;
+
+    json_writer_init(&w, buf, size);
+    if (entity == DISCOVERY_DISTANCE) {
+        json_write_literal(&w, "{\"name\":\"Salt Level Distance\",");
+    } else {
+        json_write_literal(&w, "{\"name\":\"Salt Level Percentage\",");
+    }
+
+    // Fields shared by every entity: the availability topic backed by the last will
+    // and, if configured, how long a state stays valid without a new reading
+    json_write_literal(&w, "\"state_topic\":\"" TOPIC_BASE);
+    json_write_raw(&w, client_id, id_len);
+    json_write_literal(&w, "/state\",\"availability_topic\":\"" TOPIC_BASE);
+    json_write_raw(&w, client_id, id_len);
+    json_write_literal(&w, "/availability\",");
+#if CONFIG_HA_EXPIRE_AFTER_SEC > 0
+    json_write_literal(&w, "\"expire_after\":");
+    json_write_int(&w, CONFIG_HA_EXPIRE_AFTER_SEC);
+    json_write_literal(&w, ",");
+#endif
+
+    if (entity == DISCOVERY_DISTANCE) {
+        json_write_literal(&w, "\"unit_of_measurement\":\"cm\","
+                               "\"value_template\":\"{{ value_json.distance }}\","
+                               "\"unique_id\":\"");
+        json_write_raw(&w, client_id, id_len);
+        json_write_literal(&w, "_distance\",\"device\":{\"identifiers\":[\"");
+        json_write_raw(&w, client_id, id_len);
+        json_write_literal(&w, "\"],\"name\":\"Water Softener Salt Level\","
+                               "\"model\":\"ESP32 HC-SR04\","
+                               "\"manufacturer\":\"DIY\"}}");
+    } else {
+        json_write_literal(&w, "\"unit_of_measurement\":\"%\","
+                               "\"value_template\":\"{{ value_json.percentage }}\","
+                               "\"unique_id\":\"");
+        json_write_raw(&w, client_id, id_len);
+        json_write_literal(&w, "_percentage\",\"device\":{\"identifiers\":[\"");
+        json_write_raw(&w, client_id, id_len);
+        json_write_literal(&w, "\"]}}");
+    }
+
+    return json_writer_finish(&w) != NULL ? w.len : 0;
+}
@@ -0,0 +1,75 @@
+/* Home Assistant MQTT discovery payloads
+ *
+ * One retained config message per entity, e.g. for the distance:
+ *
+ *   {"name":"Salt Level Distance",
+ *    "state_topic":"homeassistant/sensor/<client_id>/state",
+ *    "availability_topic":"homeassistant/sensor/<client_id>/availability",
+ *    "expire_after":3600,"unit_of_measurement":"cm",
+ *    "value_template":"{{ value_json.distance }}","unique_id":"<client_id>_distance",
+ *    "device":{"identifiers":["<client_id>"],"name":"Water Softener Salt Level",
+ *              "model":"ESP32 HC-SR04","manufacturer":"DIY"}}
+ *
+ * "expire_after" is only present with CONFIG_HA_EXPIRE_AFTER_SEC > 0, and the
+ * device details other than the identifier are only sent with the distance.
+ *
+ * The firmware sends DISTANCE_DISCOVERY_PAYLOAD and PERCENTAGE_DISCOVERY_PAYLOAD,
+ * assembled at compile time for CONFIG_MQTT_CLIENT_ID. discovery_encode() builds
+ * the same bytes for any client ID at run time, for the linux fleet simulator (one
+ * client ID per virtual device); a host test checks that both agree.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "topics.h"
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+/* Fields shared by every entity: the availability topic backed by the last will and,
+ * if configured, how long a state stays valid without a new reading */
+#if CONFIG_HA_EXPIRE_AFTER_SEC > 0
+#define DISCOVERY_AVAILABILITY \
+    "\"availability_topic\":\"" AVAILABILITY_TOPIC "\"," \
+    "\"expire_after\":" STRINGIFY(CONFIG_HA_EXPIRE_AFTER_SEC) ","
+#else
+#define DISCOVERY_AVAILABILITY \
+    "\"availability_topic\":\"" AVAILABILITY_TOPIC "\","
+#endif
+
+/* Discovery payloads of the device, fully assembled at compile time */
+#define DISTANCE_DISCOVERY_PAYLOAD \
+    "{\"name\":\"Salt Level Distance\"," \
+    "\"state_topic\":\"" STATE_TOPIC "\"," \
+    DISCOVERY_AVAILABILITY \
+    "\"unit_of_measurement\":\"cm\"," \
+    "\"value_template\":\"{{ value_json.distance }}\"," \
+    "\"unique_id\":\"" CONFIG_MQTT_CLIENT_ID "_distance\"," \
+    "\"device\":{\"identifiers\":[\"" CONFIG_MQTT_CLIENT_ID "\"]," \
+    "\"name\":\"Water Softener Salt Level\"," \
+    "\"model\":\"ESP32 HC-SR04\"," \
+    "\"manufacturer\":\"DIY\"}}"
+
+#define PERCENTAGE_DISCOVERY_PAYLOAD \
+    "{\"name\":\"Salt Level Percentage\"," \
+    "\"state_topic\":\"" STATE_TOPIC "\"," \
+    DISCOVERY_AVAILABILITY \
+    "\"unit_of_measurement\":\"%\"," \
+    "\"value_template\":\"{{ value_json.percentage }}\"," \
+    "\"unique_id\":\"" CONFIG_MQTT_CLIENT_ID "_percentage\"," \
+    "\"device\":{\"identifiers\":[\"" CONFIG_MQTT_CLIENT_ID "\"]}}"
+
+typedef enum {
+    DISCOVERY_DISTANCE,
+    DISCOVERY_PERCENTAGE,
+    DISCOVERY_ENTITY_COUNT,
+} discovery_entity_t;
+
+/* Worst-case encoded size for a client ID of id_len characters, which appears
+ * four times */
+#define DISCOVERY_JSON_MAX_LEN(id_len) (400 + 4 * (id_len))
+
+/* Encode the config payload of an entity into buf. Returns the length, or 0 if it
+ * does not fit. */
+size_t discovery_encode(char *buf, size_t size, discovery_entity_t entity, const char *client_id);
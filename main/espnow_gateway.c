@@ -0,0 +1,251 @@
+/* ESP-NOW gateway */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "espnow_link.h"
+#include "espnow_gateway.h"
+#include "json_writer.h"
+#include "publisher.h"
+#include "time_sync.h"
+#include "topics.h"
+
+static const char *TAG = "ESPNOW_GW";
+
+#define RX_QUEUE_LEN 8
+
+#define NODE_ID_LEN (ESP_NOW_ETH_ALEN * 2 + 1)
+
+/* A received frame, or with len 0 a request to announce every node again */
+typedef struct {
+    int64_t rx_us;              // esp_timer_get_time() on arrival
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    int8_t rssi;
+    uint8_t len;
+    uint8_t data[ESPNOW_FRAME_MAX_LEN];
+} rx_item_t;
+
+typedef struct {
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    char id[NODE_ID_LEN];       // MAC as 12 lowercase hex digits
+    bool announced;             // Discovery published on the current connection
+} node_t;
+
+static QueueHandle_t s_rx_queue = NULL;
+static StaticQueue_t s_rx_queue_buf;
+static uint8_t s_rx_queue_storage[RX_QUEUE_LEN * sizeof(rx_item_t)];
+
+static StackType_t s_task_stack[CONFIG_ESPNOW_GATEWAY_TASK_STACK_SIZE];
+static StaticTask_t s_task_tcb;
+static volatile bool s_mqtt_up = false;
+
+/* Only touched by the gateway task */
+static node_t s_nodes[CONFIG_ESPNOW_MAX_NODES];
+static size_t s_node_count = 0;
+
+/* Runs in the Wi-Fi task: copy the frame and get out */
+static void recv_cb(const esp_now_recv_info_t *info, const uint8_t *data, int len)
+{
+    rx_item_t item;
+
+    if (len < 2 || len > ESPNOW_FRAME_MAX_LEN || data[0] != ESPNOW_FRAME_READING) {
+        return;
+    }
+    // Stamped here rather than when published, which may be much later if the
+    // queue backs up or MQTT is slow
+    item.rx_us = esp_timer_get_time();
+    memcpy(item.mac, info->src_addr, ESP_NOW_ETH_ALEN);
+    item.rssi = info->rx_ctrl->rssi;
+    item.len = (uint8_t)len;
+    memcpy(item.data, data, len);
+
+    if (xQueueSend(s_rx_queue, &item, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Receive queue full, dropping frame");
+    }
+}
+
+static node_t *find_node(const uint8_t mac[ESP_NOW_ETH_ALEN])
+{
+    for (size_t i = 0; i < s_node_count; i++) {
+        if (memcmp(s_nodes[i].mac, mac, ESP_NOW_ETH_ALEN) == 0) {
+            return &s_nodes[i];
+        }
+    }
+    if (s_node_count == CONFIG_ESPNOW_MAX_NODES) {
+        return NULL;
+    }
+
+    node_t *node = &s_nodes[s_node_count++];
+    memcpy(node->mac, mac, ESP_NOW_ETH_ALEN);
+    snprintf(node->id, sizeof(node->id), "%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    node->announced = false;
+    ESP_LOGI(TAG, "New node %s (%u of %d)", node->id, s_node_count, CONFIG_ESPNOW_MAX_NODES);
+    return node;
+}
+
+static void state_topic(char *buf, size_t size, const node_t *node)
+{
+    snprintf(buf, size, TOPIC_PREFIX "/node/%s/state", node->id);
+}
+
+/* Publish one discovery message; the entity belongs to a device of its own that
+ * Home Assistant shows as connected via the gateway */
+static bool announce_entity(const node_t *node, const char *entity, const char *name,
+                            const char *unit)
+{
+    static char topic[128];
+    static char payload[640];
+    char state[96];
+    json_writer_t w;
+
+    state_topic(state, sizeof(state), node);
+    snprintf(topic, sizeof(topic), "homeassistant/sensor/" CONFIG_MQTT_CLIENT_ID "_%s/%s/config",
+             node->id, entity);
+
+    json_writer_init(&w, payload, sizeof(payload));
+    json_write_literal(&w, "{\"name\":");
+    json_write_string(&w, name);
+    json_write_literal(&w, ",\"state_topic\":");
+    json_write_string(&w, state);
+    json_write_literal(&w, ",\"availability_topic\":\"" AVAILABILITY_TOPIC "\",\"expire_after\":");
+    json_write_int(&w, CONFIG_ESPNOW_NODE_EXPIRE_SEC);
+    json_write_literal(&w, ",\"unit_of_measurement\":");
+    json_write_string(&w, unit);
+    json_write_literal(&w, ",\"value_template\":\"{{ value_json.");
+    json_write_raw(&w, entity, strlen(entity));
+    json_write_literal(&w, " }}\",\"unique_id\":\"" CONFIG_MQTT_CLIENT_ID "_");
+    json_write_raw(&w, node->id, strlen(node->id));
+    json_write_literal(&w, "_");
+    json_write_raw(&w, entity, strlen(entity));
+    json_write_literal(&w, "\",\"device\":{\"identifiers\":[\"" CONFIG_MQTT_CLIENT_ID "_");
+    json_write_raw(&w, node->id, strlen(node->id));
+    json_write_literal(&w, "\"],\"name\":\"Water Softener Salt Level ");
+    json_write_raw(&w, node->id, strlen(node->id));
+    json_write_literal(&w, "\",\"model\":\"ESP32 HC-SR04 (ESP-NOW)\","
+                           "\"manufacturer\":\"DIY\","
+                           "\"via_device\":\"" CONFIG_MQTT_CLIENT_ID "\"}}");
+    if (json_writer_finish(&w) == NULL) {
+        ESP_LOGE(TAG, "Discovery payload for %s too long", node->id);
+        return false;
+    }
+
+    return publisher_publish_to(topic, PUB_CLASS_EVENT, payload, w.len) >= 0;
+}
+
+static void announce_node(node_t *node)
+{
+    node->announced = announce_entity(node, "distance", "Salt Level Distance", "cm") &&
+                      announce_entity(node, "percentage", "Salt Level Percentage", "%");
+    if (!node->announced) {
+        ESP_LOGW(TAG, "Failed to publish discovery for node %s, will retry", node->id);
+    }
+}
+
+static void publish_reading(node_t *node, const rx_item_t *item)
+{
+    static char topic[96];
+    static char payload[112];
+    cbor_state_t state;
+    json_writer_t w;
+
+    if (!cbor_state_decode(item->data + 1, item->len - 1, &state)) {
+        ESP_LOGW(TAG, "Malformed reading from node %s", node->id);
+        return;
+    }
+    if (!s_mqtt_up) {
+        return;
+    }
+    if (!node->announced) {
+        announce_node(node);
+    }
+
+    json_writer_init(&w, payload, sizeof(payload));
+    json_write_literal(&w, "{\"distance\":");
+    json_write_fixed(&w, state.distance_mm, 1);
+    json_write_literal(&w, ",\"percentage\":");
+    json_write_fixed(&w, state.percentage_tenths, 1);
+    json_write_literal(&w, ",\"rssi\":");
+    json_write_int(&w, item->rssi);
+    // Nodes have no wall clock, so the reading is timed by its arrival here
+    if (time_sync_valid()) {
+        json_write_literal(&w, ",\"timestamp_us\":");
+        json_write_int(&w, time_sync_from_timer_us(item->rx_us));
+    }
+    json_write_literal(&w, "}");
+    if (json_writer_finish(&w) == NULL) {
+        return;
+    }
+
+    state_topic(topic, sizeof(topic), node);
+    int msg_id = publisher_publish_to(topic, PUB_CLASS_STATE, payload, w.len);
+    ESP_LOGI(TAG, "Node %s: %s (msg_id=%d)", node->id, payload, msg_id);
+}
+
+static void gateway_task(void *pvParameters)
+{
+    static rx_item_t item;
+
+    while (1) {
+        xQueueReceive(s_rx_queue, &item, portMAX_DELAY);
+
+        if (item.len == 0) {
+            // Discovery does not survive a broker without a persistent session, and
+            // Home Assistant forgets it on restart: announce every node again
+            for (size_t i = 0; i < s_node_count; i++) {
+                announce_node(&s_nodes[i]);
+            }
+            continue;
+        }
+
+        node_t *node = find_node(item.mac);
+        if (node == NULL) {
+            ESP_LOGW(TAG, "Node table full, ignoring " MACSTR, MAC2STR(item.mac));
+            continue;
+        }
+        publish_reading(node, &item);
+    }
+}
+
+esp_err_t espnow_gateway_start(void)
+{
+    s_rx_queue = xQueueCreateStatic(RX_QUEUE_LEN, sizeof(rx_item_t), s_rx_queue_storage,
+                                    &s_rx_queue_buf);
+
+    // Frames arriving while the radio sleeps between beacons would be lost
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+    ESP_ERROR_CHECK(esp_now_init());
+    ESP_ERROR_CHECK(esp_now_register_recv_cb(recv_cb));
+
+    xTaskCreateStatic(gateway_task, "espnow_gw", CONFIG_ESPNOW_GATEWAY_TASK_STACK_SIZE, NULL, 4,
+                      s_task_stack, &s_task_tcb);
+
+    // Nodes need this address as CONFIG_ESPNOW_GATEWAY_MAC
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    esp_wifi_get_mac(WIFI_IF_STA, mac);
+    ESP_LOGI(TAG, "Gateway " MACSTR " listening for up to %d nodes", MAC2STR(mac),
+             CONFIG_ESPNOW_MAX_NODES);
+    return ESP_OK;
+}
+
+void espnow_gateway_mqtt_connected(void)
+{
+    const rx_item_t announce = { .len = 0 };
+
+    s_mqtt_up = true;
+    if (s_rx_queue != NULL) {
+        xQueueSend(s_rx_queue, &announce, 0);
+    }
+}
+
+void espnow_gateway_mqtt_disconnected(void)
+{
+    s_mqtt_up = false;
+}
@@ -0,0 +1,28 @@
+/* ESP-NOW gateway
+ *
+ * Gateway side of the ESP-NOW link (see espnow_link.h). Receives readings from up
+ * to CONFIG_ESPNOW_MAX_NODES sensor nodes and publishes each on
+ *
+ *   <prefix>/node/<mac>/state   {"distance":..,"percentage":..,"rssi":..}
+ *
+ * with a Home Assistant device per node, announced the first time a node is heard
+ * and again after every MQTT (re)connect. Node entities share the gateway's
+ * availability topic and expire after CONFIG_ESPNOW_NODE_EXPIRE_SEC without a reading.
+ *
+ * ESP-NOW receives on the channel of the access point the gateway is connected to,
+ * so nodes must be configured for that channel.
+ */
+
+#pragma once
+
+#include "esp_err.h"
+
+/* Start receiving. Wi-Fi must already be started. */
+esp_err_t espnow_gateway_start(void);
+
+/* Call on MQTT_EVENT_CONNECTED and when Home Assistant comes online: node readings
+ * are published from now on and every known node is announced again. */
+void espnow_gateway_mqtt_connected(void);
+
+/* Call on MQTT_EVENT_DISCONNECTED: node readings are dropped until reconnected */
+void espnow_gateway_mqtt_disconnected(void);
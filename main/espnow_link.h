@@ -0,0 +1,19 @@
+/* ESP-NOW sensor link
+ *
+ * Lets many tanks share one broker connection. Sensor nodes never join Wi-Fi:
+ * each reading goes out as a single ESP-NOW frame, which costs a few milliseconds
+ * of radio time instead of association, DHCP and an MQTT connect. A gateway runs
+ * the normal Wi-Fi/MQTT stack and bridges every node's readings to MQTT, with its
+ * own Home Assistant device per node.
+ *
+ * A frame is a one-byte type followed by the compact CBOR state map from
+ * cbor_state.h. Nodes are identified by their MAC address.
+ */
+
+#pragma once
+
+#include "cbor_state.h"
+
+#define ESPNOW_FRAME_READING 0x01
+
+#define ESPNOW_FRAME_MAX_LEN (1 + CBOR_STATE_MAX_LEN)
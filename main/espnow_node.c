@@ -0,0 +1,103 @@
+/* ESP-NOW sensor node */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "espnow_link.h"
+#include "espnow_node.h"
+
+static const char *TAG = "ESPNOW_NODE";
+
+#define SEND_ATTEMPTS    3
+#define SEND_TIMEOUT_MS  100
+
+static uint8_t s_gateway[ESP_NOW_ETH_ALEN];
+static QueueHandle_t s_send_status;
+static StaticQueue_t s_send_status_buf;
+static uint8_t s_send_status_storage[sizeof(esp_now_send_status_t)];
+
+/* Runs in the Wi-Fi task once the frame went out (and, for unicast, was acked) */
+static void send_cb(const esp_now_send_info_t *tx_info, esp_now_send_status_t status)
+{
+    xQueueOverwrite(s_send_status, &status);
+}
+
+static esp_err_t parse_mac(const char *str, uint8_t mac[ESP_NOW_ETH_ALEN])
+{
+    unsigned int b[ESP_NOW_ETH_ALEN];
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != ESP_NOW_ETH_ALEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < ESP_NOW_ETH_ALEN; i++) {
+        mac[i] = (uint8_t)b[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t espnow_node_init(void)
+{
+    esp_err_t err = parse_mac(CONFIG_ESPNOW_GATEWAY_MAC, s_gateway);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Invalid gateway MAC \"%s\"", CONFIG_ESPNOW_GATEWAY_MAC);
+        return err;
+    }
+
+    s_send_status = xQueueCreateStatic(1, sizeof(esp_now_send_status_t), s_send_status_storage,
+                                       &s_send_status_buf);
+
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(esp_wifi_set_channel(CONFIG_ESPNOW_CHANNEL, WIFI_SECOND_CHAN_NONE));
+
+    ESP_ERROR_CHECK(esp_now_init());
+    ESP_ERROR_CHECK(esp_now_register_send_cb(send_cb));
+
+    esp_now_peer_info_t peer = {
+        .channel = CONFIG_ESPNOW_CHANNEL,
+        .ifidx = WIFI_IF_STA,
+        .encrypt = false,
+    };
+    memcpy(peer.peer_addr, s_gateway, ESP_NOW_ETH_ALEN);
+    ESP_ERROR_CHECK(esp_now_add_peer(&peer));
+
+    ESP_LOGI(TAG, "Sending to gateway %s on channel %d", CONFIG_ESPNOW_GATEWAY_MAC, CONFIG_ESPNOW_CHANNEL);
+    return ESP_OK;
+}
+
+esp_err_t espnow_node_send(const reading_t *reading)
+{
+    uint8_t frame[ESPNOW_FRAME_MAX_LEN];
+
+    frame[0] = ESPNOW_FRAME_READING;
+    // Nodes have no wall clock; the gateway timestamps readings on arrival
+    size_t len = 1 + cbor_state_encode(frame + 1, sizeof(frame) - 1, reading->distance_cm,
+                                       reading->percentage, 0);
+
+    for (int attempt = 1; attempt <= SEND_ATTEMPTS; attempt++) {
+        esp_now_send_status_t status;
+
+        xQueueReset(s_send_status);
+        esp_err_t err = esp_now_send(s_gateway, frame, len);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "esp_now_send failed: %s", esp_err_to_name(err));
+            continue;
+        }
+        if (xQueueReceive(s_send_status, &status, pdMS_TO_TICKS(SEND_TIMEOUT_MS)) == pdTRUE &&
+            status == ESP_NOW_SEND_SUCCESS) {
+            return ESP_OK;
+        }
+    }
+
+    ESP_LOGW(TAG, "Gateway did not acknowledge reading after %d attempts", SEND_ATTEMPTS);
+    return ESP_FAIL;
+}
@@ -0,0 +1,18 @@
+/* ESP-NOW sensor node
+ *
+ * Node side of the ESP-NOW link (see espnow_link.h). The radio is started on
+ * CONFIG_ESPNOW_CHANNEL without connecting to an access point; the gateway's
+ * access point must use the same channel.
+ */
+
+#pragma once
+
+#include "esp_err.h"
+#include "reading.h"
+
+/* Start the radio for ESP-NOW only and register the gateway as a peer */
+esp_err_t espnow_node_init(void);
+
+/* Send a reading to the gateway. Returns ESP_OK once it was delivered (for a
+ * unicast gateway address, acknowledged at the MAC layer). */
+esp_err_t espnow_node_send(const reading_t *reading);
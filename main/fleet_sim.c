@@ -0,0 +1,558 @@
+/* Virtual fleet load generator (linux target) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "discovery.h"
+#include "json_state.h"
+#include "ranging.h"
+#include "settings.h"
+#include "sim_tank.h"
+#include "time_sync.h"
+#include "topics.h"
+#include "fleet_sim.h"
+
+static const char *TAG = "FLEET_SIM";
+
+/* Start of every virtual device's topics, and only theirs */
+#define FLEET_TOPIC_PREFIX  TOPIC_BASE CONFIG_MQTT_CLIENT_ID "_"
+
+/* CONFIG_MQTT_CLIENT_ID plus "_" and a device number of up to four digits */
+#define ID_LEN              (sizeof(CONFIG_MQTT_CLIENT_ID) + 5)
+#define TOPIC_LEN           (sizeof(TOPIC_BASE) + ID_LEN + sizeof("/percentage/config"))
+
+#define INTERVAL_US         ((int64_t)CONFIG_FLEET_SIM_INTERVAL_MS * 1000)
+#define REPORT_US           ((int64_t)CONFIG_FLEET_SIM_REPORT_SEC * 1000000)
+
+/* The driver task wakes this often to start clients and send the readings due */
+#define TICK_MS             10
+#define DRIVER_STACK_SIZE   4096
+#define DRIVER_PRIORITY     5
+
+#if CONFIG_PUB_STATE_RETAIN
+#define STATE_RETAIN true
+#else
+#define STATE_RETAIN false
+#endif
+#if CONFIG_PUB_EVENT_RETAIN
+#define EVENT_RETAIN true
+#else
+#define EVENT_RETAIN false
+#endif
+
+/* Latencies go into log-scaled buckets: one per microsecond below 16 us, then 16 per
+ * power of two, so a bucket is never wider than 1/16 of its values, up to 2^26 us
+ * (67 s). The last bucket takes anything slower. A few hundred buckets keep the
+ * copy in hist_snapshot() short. */
+#define HIST_SUB_BITS       4
+#define HIST_SUB            (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS       26
+#define HIST_BUCKETS        ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint32_t count;
+    int64_t min_us;
+    int64_t max_us;
+    int64_t sum_us;
+    uint32_t buckets[HIST_BUCKETS];
+} latency_hist_t;
+
+typedef struct {
+    char id[ID_LEN];
+    char state_topic[TOPIC_LEN];
+    char availability_topic[TOPIC_LEN];
+    char distance_config_topic[TOPIC_LEN];
+    char percentage_config_topic[TOPIC_LEN];
+    esp_mqtt_client_handle_t client;
+    atomic_bool connected;
+    // Driver task only
+    sim_tank_t tank;
+    int64_t next_reading_us;
+    // Client task only
+    int64_t connect_start_us;
+    int64_t discovery_start_us;
+    int discovery_msg_ids[DISCOVERY_ENTITY_COUNT];
+    int discovery_pending;
+} fleet_device_t;
+
+static fleet_device_t s_devices[CONFIG_FLEET_SIM_DEVICES];
+static esp_mqtt_client_handle_t s_probe = NULL;
+
+static StackType_t s_driver_stack[DRIVER_STACK_SIZE];
+static StaticTask_t s_driver_tcb;
+
+/* Recorded from every client task and read by the driver task's report */
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static latency_hist_t s_e2e_hist;           // Readings received since the last report
+static latency_hist_t s_connect_hist;
+static latency_hist_t s_discovery_hist;
+static latency_hist_t s_report_hist;        // Report scratch space
+static atomic_uint s_disconnects;
+
+/* Driver task only */
+static uint32_t s_sent = 0;
+static uint32_t s_failed = 0;
+static uint32_t s_no_echo = 0;
+static pid_t s_broker_pid = 0;
+static uint64_t s_broker_ticks = 0;
+static int64_t s_broker_sample_us = 0;
+
+static size_t hist_bucket(int64_t us)
+{
+    if (us < HIST_SUB) {
+        return us;
+    }
+    if (us >= (int64_t)1 << HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    // The top HIST_SUB_BITS + 1 bits, the leading one giving the power of two
+    int msb = 63 - __builtin_clzll(us);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value above a bucket */
+static int64_t hist_bucket_end(size_t bucket)
+{
+    if (bucket < HIST_SUB) {
+        return bucket + 1;
+    }
+    int shift = bucket / HIST_SUB - 1;
+    return (int64_t)(HIST_SUB + bucket % HIST_SUB + 1) << shift;
+}
+
+static void hist_record(latency_hist_t *h, int64_t us)
+{
+    // The wall clock may step between send and receive
+    if (us < 0) {
+        us = 0;
+    }
+    size_t bucket = hist_bucket(us);
+
+    taskENTER_CRITICAL(&s_lock);
+    if (h->count == 0 || us < h->min_us) {
+        h->min_us = us;
+    }
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+    h->count++;
+    h->sum_us += us;
+    h->buckets[bucket]++;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/* Copy a histogram into s_report_hist, optionally starting it over */
+static const latency_hist_t *hist_snapshot(latency_hist_t *h, bool reset)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_report_hist = *h;
+    if (reset) {
+        memset(h, 0, sizeof(*h));
+    }
+    taskEXIT_CRITICAL(&s_lock);
+    return &s_report_hist;
+}
+
+/* Nearest-rank percentile, as the upper edge of its bucket but never above the maximum */
+static int64_t hist_percentile(const latency_hist_t *h, unsigned pct)
+{
+    uint32_t rank = ((uint64_t)h->count * pct + 99) / 100;
+    uint32_t seen = 0;
+
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            int64_t edge = hist_bucket_end(i);
+            return edge < h->max_us ? edge : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void log_hist(const char *what, const latency_hist_t *h)
+{
+    if (h->count == 0) {
+        ESP_LOGI(TAG, "%-12s no samples", what);
+        return;
+    }
+    ESP_LOGI(TAG, "%-12s n=%" PRIu32 " min=%.1f mean=%.1f p50=%.1f p99=%.1f max=%.1f ms",
+             what, h->count, h->min_us / 1000.0, (double)h->sum_us / h->count / 1000.0,
+             hist_percentile(h, 50) / 1000.0, hist_percentile(h, 99) / 1000.0,
+             h->max_us / 1000.0);
+}
+
+/* Send both discovery messages and start timing their ingest. QoS 1 whatever the
+ * event class uses, since the broker's PUBACK is what the ingest time ends on. */
+static void publish_discovery(fleet_device_t *dev)
+{
+    const char *topics[DISCOVERY_ENTITY_COUNT] = {
+        [DISCOVERY_DISTANCE] = dev->distance_config_topic,
+        [DISCOVERY_PERCENTAGE] = dev->percentage_config_topic,
+    };
+    char payload[DISCOVERY_JSON_MAX_LEN(ID_LEN)];
+
+    dev->discovery_pending = 0;
+    dev->discovery_start_us = esp_timer_get_time();
+    for (int i = 0; i < DISCOVERY_ENTITY_COUNT; i++) {
+        // The firmware's own payloads, for this device's client ID
+        size_t len = discovery_encode(payload, sizeof(payload), i, dev->id);
+        int msg_id = len > 0 ? esp_mqtt_client_enqueue(dev->client, topics[i], payload, len,
+                                                       1, true, true) : -1;
+        if (msg_id < 0) {
+            ESP_LOGW(TAG, "%s: failed to publish discovery", dev->id);
+            dev->discovery_pending = 0;
+            return;
+        }
+        dev->discovery_msg_ids[dev->discovery_pending++] = msg_id;
+    }
+}
+
+static bool event_topic_is(esp_mqtt_event_handle_t event, const char *topic)
+{
+    return event->topic_len == (int)strlen(topic) &&
+           memcmp(event->topic, topic, event->topic_len) == 0;
+}
+
+/* Event handler of every virtual device; handler_args is the device */
+static void device_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id,
+                                 void *event_data)
+{
+    fleet_device_t *dev = handler_args;
+    esp_mqtt_event_handle_t event = event_data;
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        dev->connect_start_us = esp_timer_get_time();
+        break;
+    case MQTT_EVENT_CONNECTED:
+        hist_record(&s_connect_hist, esp_timer_get_time() - dev->connect_start_us);
+        esp_mqtt_client_subscribe(dev->client, CONFIG_HA_STATUS_TOPIC, 1);
+        // A virtual device has no NVS of its own, so it behaves like a first boot:
+        // discovery unless the broker kept the session, then "online"
+        if (!event->session_present) {
+            publish_discovery(dev);
+        }
+        esp_mqtt_client_enqueue(dev->client, dev->availability_topic, AVAILABILITY_ONLINE, 0,
+                                CONFIG_PUB_EVENT_QOS, EVENT_RETAIN, true);
+        atomic_store(&dev->connected, true);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        atomic_store(&dev->connected, false);
+        atomic_fetch_add(&s_disconnects, 1);
+        dev->discovery_pending = 0;
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        for (int i = 0; i < dev->discovery_pending; i++) {
+            if (dev->discovery_msg_ids[i] == event->msg_id) {
+                dev->discovery_msg_ids[i] = dev->discovery_msg_ids[--dev->discovery_pending];
+                if (dev->discovery_pending == 0) {
+                    hist_record(&s_discovery_hist, esp_timer_get_time() - dev->discovery_start_us);
+                }
+                break;
+            }
+        }
+        break;
+    case MQTT_EVENT_DATA:
+        // Home Assistant's birth message: every device resends discovery, as the firmware does
+        if (event_topic_is(event, CONFIG_HA_STATUS_TOPIC) &&
+            event->data_len == (int)strlen("online") &&
+            memcmp(event->data, "online", event->data_len) == 0) {
+            publish_discovery(dev);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Event handler of the probe client, which receives every virtual device's readings */
+static void probe_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id,
+                                void *event_data)
+{
+    esp_mqtt_event_handle_t event = event_data;
+    char payload[JSON_STATE_MAX_LEN + 1];
+
+    switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_CONNECTED:
+        esp_mqtt_client_subscribe(s_probe, TOPIC_BASE "+/state", 0);
+        break;
+    case MQTT_EVENT_DATA: {
+        int64_t now_us = time_sync_now_us();
+
+        // Retained states were sent before this run (or before the probe subscribed)
+        if (event->retain || event->current_data_offset != 0 ||
+            event->data_len > JSON_STATE_MAX_LEN ||
+            event->topic_len < (int)strlen(FLEET_TOPIC_PREFIX) ||
+            memcmp(event->topic, FLEET_TOPIC_PREFIX, strlen(FLEET_TOPIC_PREFIX)) != 0) {
+            break;
+        }
+        memcpy(payload, event->data, event->data_len);
+        payload[event->data_len] = '\0';
+
+        const char *ts = strstr(payload, "\"timestamp_us\":");
+        if (ts != NULL) {
+            hist_record(&s_e2e_hist, now_us - strtoll(ts + strlen("\"timestamp_us\":"), NULL, 10));
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* Broker URL, credentials and protocol as configured for the device */
+static void base_config(esp_mqtt_client_config_t *cfg, const char *client_id)
+{
+    *cfg = (esp_mqtt_client_config_t) {
+        .broker.address.uri = CONFIG_MQTT_BROKER_URL,
+        .credentials.client_id = client_id,
+#if CONFIG_MQTT5_ENABLE
+        .session.protocol_ver = MQTT_PROTOCOL_V_5,
+#else
+        .session.protocol_ver = MQTT_PROTOCOL_V_3_1_1,
+#endif
+    };
+    if (strlen(CONFIG_MQTT_USERNAME) > 0) {
+        cfg->credentials.username = CONFIG_MQTT_USERNAME;
+    }
+    if (strlen(CONFIG_MQTT_PASSWORD) > 0) {
+        cfg->credentials.authentication.password = CONFIG_MQTT_PASSWORD;
+    }
+}
+
+static void start_device(fleet_device_t *dev)
+{
+    esp_mqtt_client_config_t cfg;
+
+    base_config(&cfg, dev->id);
+    // Lets Home Assistant mark the device's entities unavailable when it drops off
+    cfg.session.last_will.topic = dev->availability_topic;
+    cfg.session.last_will.msg = AVAILABILITY_OFFLINE;
+    cfg.session.last_will.qos = 1;
+    cfg.session.last_will.retain = true;
+
+    dev->client = esp_mqtt_client_init(&cfg);
+    if (dev->client == NULL) {
+        ESP_LOGE(TAG, "%s: failed to create the MQTT client", dev->id);
+        return;
+    }
+    esp_mqtt_client_register_event(dev->client, ESP_EVENT_ANY_ID, device_event_handler, dev);
+    esp_mqtt_client_start(dev->client);
+}
+
+/* Take and publish one reading, the way the sensor and publish tasks do */
+static void send_reading(fleet_device_t *dev, const settings_t *settings)
+{
+    int64_t echo_us = sim_tank_echo_us(&dev->tank, esp_timer_get_time(), settings->tank_height_cm);
+    reading_t reading;
+    char payload[JSON_STATE_MAX_LEN];
+
+    // Failed readings are not published
+    if (!ranging_make_reading(echo_us, 0, settings, false, &reading)) {
+        s_no_echo++;
+        return;
+    }
+    // Stamped last, so the latency covers only the trip through client and broker
+    reading.timestamp_us = time_sync_now_us();
+
+    size_t len = json_state_encode(payload, sizeof(payload), &reading);
+    if (len > 0 && esp_mqtt_client_enqueue(dev->client, dev->state_topic, payload, len,
+                                           CONFIG_PUB_STATE_QOS, STATE_RETAIN, true) >= 0) {
+        s_sent++;
+    } else {
+        s_failed++;
+    }
+}
+
+/* Process ID of the broker if it runs on this host, found by name in /proc */
+static pid_t find_broker(void)
+{
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    pid_t pid = 0;
+
+    if (proc == NULL) {
+        return 0;
+    }
+    while (pid == 0 && (entry = readdir(proc)) != NULL) {
+        char path[sizeof(entry->d_name) + 16];
+        char comm[32];
+
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            continue;
+        }
+        if (fgets(comm, sizeof(comm), f) != NULL) {
+            comm[strcspn(comm, "\n")] = '\0';
+            if (strcmp(comm, CONFIG_FLEET_SIM_BROKER_PROCESS) == 0) {
+                pid = atoi(entry->d_name);
+            }
+        }
+        fclose(f);
+    }
+    closedir(proc);
+    return pid;
+}
+
+/* User plus system CPU time of the broker in clock ticks */
+static bool broker_cpu_ticks(pid_t pid, uint64_t *ticks)
+{
+    char path[32];
+    char stat[512];
+    unsigned long long utime;
+    unsigned long long stime;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    bool ok = fgets(stat, sizeof(stat), f) != NULL;
+    fclose(f);
+
+    // Fields 14 and 15; the command name before them may contain spaces
+    const char *p = ok ? strrchr(stat, ')') : NULL;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                            &utime, &stime) != 2) {
+        return false;
+    }
+    *ticks = utime + stime;
+    return true;
+}
+
+static void log_broker_cpu(int64_t now_us)
+{
+    uint64_t ticks;
+
+    if (s_broker_pid == 0 || !broker_cpu_ticks(s_broker_pid, &ticks)) {
+        // Not found yet, or restarted since
+        s_broker_pid = find_broker();
+        s_broker_sample_us = 0;
+        if (s_broker_pid == 0 || !broker_cpu_ticks(s_broker_pid, &ticks)) {
+            ESP_LOGI(TAG, "broker CPU   no local \"%s\" process", CONFIG_FLEET_SIM_BROKER_PROCESS);
+            return;
+        }
+    }
+
+    if (s_broker_sample_us != 0) {
+        double cpu_sec = (double)(ticks - s_broker_ticks) / sysconf(_SC_CLK_TCK);
+        ESP_LOGI(TAG, "broker CPU   %.1f%% of a core (pid %d)",
+                 100.0 * cpu_sec / ((now_us - s_broker_sample_us) / 1e6), (int)s_broker_pid);
+    }
+    s_broker_ticks = ticks;
+    s_broker_sample_us = now_us;
+}
+
+static void report(int64_t now_us, size_t started)
+{
+    size_t connected = 0;
+
+    for (size_t i = 0; i < started; i++) {
+        connected += atomic_load(&s_devices[i].connected);
+    }
+    ESP_LOGI(TAG, "%zu/%d devices connected, %u disconnects; last %d s: %" PRIu32 " sent, "
+             "%" PRIu32 " failed, %" PRIu32 " without echo",
+             connected, CONFIG_FLEET_SIM_DEVICES, atomic_load(&s_disconnects),
+             CONFIG_FLEET_SIM_REPORT_SEC, s_sent, s_failed, s_no_echo);
+    s_sent = 0;
+    s_failed = 0;
+    s_no_echo = 0;
+
+    log_hist("end-to-end", hist_snapshot(&s_e2e_hist, true));
+    log_hist("connect", hist_snapshot(&s_connect_hist, false));
+    log_hist("discovery", hist_snapshot(&s_discovery_hist, false));
+    log_broker_cpu(now_us);
+}
+
+/* Starts the clients at the ramp rate, then sends each device's readings when due */
+static void driver_task(void *pvParameters)
+{
+    int64_t start_us = esp_timer_get_time();
+    int64_t next_report_us = start_us + REPORT_US;
+    TickType_t last_wake = xTaskGetTickCount();
+    size_t started = 0;
+
+    for (;;) {
+        int64_t now_us = esp_timer_get_time();
+        const settings_t *settings = settings_current();
+
+        size_t due = (now_us - start_us) * CONFIG_FLEET_SIM_RAMP_PER_SEC / 1000000 + 1;
+        while (started < due && started < CONFIG_FLEET_SIM_DEVICES) {
+            fleet_device_t *dev = &s_devices[started];
+            // Spread evenly over the interval, so the broker sees a steady rate
+            dev->next_reading_us = now_us + INTERVAL_US * started / CONFIG_FLEET_SIM_DEVICES;
+            start_device(dev);
+            started++;
+        }
+
+        for (size_t i = 0; i < started; i++) {
+            fleet_device_t *dev = &s_devices[i];
+            if (now_us < dev->next_reading_us) {
+                continue;
+            }
+            // A device offline at its reading time skips it, like the firmware
+            // without the offline queue
+            if (atomic_load(&dev->connected)) {
+                send_reading(dev, settings);
+            }
+            dev->next_reading_us += INTERVAL_US;
+            // Fell behind: keep the phase rather than sending a burst
+            while (dev->next_reading_us <= now_us) {
+                dev->next_reading_us += INTERVAL_US;
+            }
+        }
+
+        if (now_us >= next_report_us) {
+            report(now_us, started);
+            next_report_us += REPORT_US;
+        }
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(TICK_MS));
+    }
+}
+
+void fleet_sim_start(void)
+{
+    esp_mqtt_client_config_t probe_cfg;
+
+    ESP_LOGI(TAG, "%d virtual devices, a reading every %d ms each, connecting %d per second",
+             CONFIG_FLEET_SIM_DEVICES, CONFIG_FLEET_SIM_INTERVAL_MS, CONFIG_FLEET_SIM_RAMP_PER_SEC);
+    ESP_LOGI(TAG, "Broker URL: %s", CONFIG_MQTT_BROKER_URL);
+
+    for (int i = 0; i < CONFIG_FLEET_SIM_DEVICES; i++) {
+        fleet_device_t *dev = &s_devices[i];
+
+        snprintf(dev->id, sizeof(dev->id), "%s_%04d", CONFIG_MQTT_CLIENT_ID, i);
+        snprintf(dev->state_topic, sizeof(dev->state_topic), TOPIC_BASE "%s/state", dev->id);
+        snprintf(dev->availability_topic, sizeof(dev->availability_topic),
+                 TOPIC_BASE "%s/availability", dev->id);
+        snprintf(dev->distance_config_topic, sizeof(dev->distance_config_topic),
+                 TOPIC_BASE "%s/distance/config", dev->id);
+        snprintf(dev->percentage_config_topic, sizeof(dev->percentage_config_topic),
+                 TOPIC_BASE "%s/percentage/config", dev->id);
+        // Consecutive seeds give every tank its own noise and missing echoes
+        sim_tank_init(&dev->tank, CONFIG_SIM_SEED + i, CONFIG_SIM_START_DISTANCE_CM);
+    }
+
+    // The probe connects first so it sees the readings from the start
+    base_config(&probe_cfg, CONFIG_MQTT_CLIENT_ID "_probe");
+    s_probe = esp_mqtt_client_init(&probe_cfg);
+    esp_mqtt_client_register_event(s_probe, ESP_EVENT_ANY_ID, probe_event_handler, NULL);
+    esp_mqtt_client_start(s_probe);
+
+    xTaskCreateStatic(driver_task, "fleet_driver", DRIVER_STACK_SIZE, NULL, DRIVER_PRIORITY,
+                      s_driver_stack, &s_driver_tcb);
+}
@@ -0,0 +1,29 @@
+/* Virtual fleet load generator (linux target)
+ *
+ * With CONFIG_FLEET_SIM_ENABLE the linux build runs CONFIG_FLEET_SIM_DEVICES virtual
+ * salt level monitors instead of the one device, to size the broker and Home
+ * Assistant for a larger fleet without the boards. Each virtual device has its own
+ * MQTT client, client ID (CONFIG_MQTT_CLIENT_ID "_0000", "_0001", ...), topics,
+ * last will and simulated tank (see sim_tank.h), and behaves like the firmware on
+ * the wire: on connecting it sends its retained discovery messages and "online",
+ * it resends discovery when Home Assistant comes online, and it publishes a reading
+ * every CONFIG_FLEET_SIM_INTERVAL_MS, ranged and encoded by the firmware's own
+ * code. Readings are spread evenly over the interval, and clients connect at
+ * CONFIG_FLEET_SIM_RAMP_PER_SEC so the ramp-up can be watched too.
+ *
+ * Every CONFIG_FLEET_SIM_REPORT_SEC the generator logs:
+ * - end-to-end latency of the readings in that period: a probe client subscribed
+ *   to every state topic compares each arrival with the reading's "timestamp_us"
+ * - MQTT connect and discovery ingest times since the start. Ingest runs from
+ *   sending a device's discovery messages to the broker acknowledging both, i.e.
+ *   having stored them as retained; what Home Assistant does with them afterwards
+ *   is not visible over MQTT.
+ * - the broker's CPU use, when a process named CONFIG_FLEET_SIM_BROKER_PROCESS runs
+ *   on the same host
+ */
+
+#pragma once
+
+/* Start the fleet. Call once settings_init() has run, instead of starting the
+ * device's own network and tasks. */
+void fleet_sim_start(void);
@@ -0,0 +1,42 @@
+/* Hardware shims
+ *
+ * The two things the application needs from the board: an HC-SR04 to range with
+ * and a network link to publish over. hal_esp32.c drives the GPIOs and the Wi-Fi
+ * station; hal_linux.c, built for the ESP-IDF linux target, simulates a slowly
+ * emptying tank and treats the host's network as always up. Everything above this
+ * interface (sampling, payload building, the connection state machine) is the
+ * same code on both, so it can be run, profiled and debugged on a development
+ * machine without flashing a board.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/* hal_ranging_echo_us() results when the sensor did not answer */
+#define ECHO_NO_START (-1)
+#define ECHO_NO_END   (-2)
+
+/* Trigger a ping and time the echo pulse. Returns the pulse width in microseconds,
+ * or ECHO_NO_START / ECHO_NO_END. *edge_us is set to the esp_timer time of the
+ * echo's rising edge, or of the trigger if there was none. */
+int64_t hal_ranging_echo_us(int64_t *edge_us);
+
+typedef enum {
+    HAL_NET_STARTED,            // Interface is up; call hal_net_connect()
+    HAL_NET_GOT_IP,             // Connected with an address
+    HAL_NET_DISCONNECTED,       // Connect failed or the link dropped
+} hal_net_event_t;
+
+typedef void (*hal_net_handler_t)(hal_net_event_t event);
+
+/* Bring up the network interface. Link events are passed to handler, which must
+ * not block. */
+void hal_net_start(hal_net_handler_t handler);
+
+/* Start a connection attempt; the outcome arrives as an event */
+void hal_net_connect(void);
+
+/* Signal strength of the current link, in dBm */
+esp_err_t hal_net_rssi(int8_t *rssi);
@@ -0,0 +1,131 @@
+/* Hardware shims: HC-SR04 on GPIO and the Wi-Fi station */
+
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "driver/gpio.h"
+#include "bench.h"
+#include "hal.h"
+
+static const char *TAG = "HAL";
+
+static hal_net_handler_t s_net_handler = NULL;
+
+int64_t hal_ranging_echo_us(int64_t *edge_us)
+{
+    uint32_t t = bench_now();
+
+    // Configure GPIO pins
+    gpio_set_direction(CONFIG_SENSOR_TRIG_GPIO, GPIO_MODE_OUTPUT);
+    gpio_set_direction(CONFIG_SENSOR_ECHO_GPIO, GPIO_MODE_INPUT);
+
+    // Send 10us trigger pulse
+    gpio_set_level(CONFIG_SENSOR_TRIG_GPIO, 0);
+    esp_rom_delay_us(2);
+    gpio_set_level(CONFIG_SENSOR_TRIG_GPIO, 1);
+    esp_rom_delay_us(10);
+    gpio_set_level(CONFIG_SENSOR_TRIG_GPIO, 0);
+    *edge_us = esp_timer_get_time();
+    t = bench_record(BENCH_TRIGGER, t);
+
+    // Wait for echo pin to go high (with timeout)
+    int timeout = 0;
+    while (gpio_get_level(CONFIG_SENSOR_ECHO_GPIO) == 0 && timeout < 10000) {
+        esp_rom_delay_us(1);
+        timeout++;
+    }
+
+    if (timeout >= 10000) {
+        return ECHO_NO_START;
+    }
+
+    t = bench_record(BENCH_ECHO_WAIT, t);
+
+    // Measure pulse width
+    int64_t start_time = esp_timer_get_time();
+    *edge_us = start_time;
+    timeout = 0;
+
+    while (gpio_get_level(CONFIG_SENSOR_ECHO_GPIO) == 1 && timeout < 30000) {
+        esp_rom_delay_us(1);
+        timeout++;
+    }
+
+    if (timeout >= 30000) {
+        return ECHO_NO_END;
+    }
+
+    int64_t end_time = esp_timer_get_time();
+    bench_record(BENCH_ECHO_PULSE, t);
+    return end_time - start_time;
+}
+
+/* Translate Wi-Fi and IP events into link events */
+static void event_handler(void* arg, esp_event_base_t event_base,
+                          int32_t event_id, void* event_data)
+{
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        s_net_handler(HAL_NET_STARTED);
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        s_net_handler(HAL_NET_DISCONNECTED);
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
+        s_net_handler(HAL_NET_GOT_IP);
+    }
+}
+
+void hal_net_start(hal_net_handler_t handler)
+{
+    s_net_handler = handler;
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+    esp_event_handler_instance_t instance_any_id;
+    esp_event_handler_instance_t instance_got_ip;
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                        ESP_EVENT_ANY_ID,
+                                                        &event_handler,
+                                                        NULL,
+                                                        &instance_any_id));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                        IP_EVENT_STA_GOT_IP,
+                                                        &event_handler,
+                                                        NULL,
+                                                        &instance_got_ip));
+
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = CONFIG_WIFI_SSID,
+            .password = CONFIG_WIFI_PASSWORD,
+            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
+        },
+    };
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    ESP_ERROR_CHECK(esp_wifi_start() );
+}
+
+void hal_net_connect(void)
+{
+    esp_wifi_connect();
+}
+
+esp_err_t hal_net_rssi(int8_t *rssi)
+{
+    wifi_ap_record_t ap;
+
+    esp_err_t err = esp_wifi_sta_get_ap_info(&ap);
+    if (err == ESP_OK) {
+        *rssi = ap.rssi;
+    }
+    return err;
+}
@@ -0,0 +1,74 @@
+/* Hardware shims for the linux target: a simulated tank and the host's network */
+
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "hal.h"
+#include "settings.h"
+#include "sim_tank.h"
+
+static const char *TAG = "HAL_SIM";
+
+static hal_net_handler_t s_net_handler = NULL;
+static volatile bool s_link_up = true;
+static sim_tank_t s_tank = {
+    .rng = CONFIG_SIM_SEED,
+    .start_cm = CONFIG_SIM_START_DISTANCE_CM,
+};
+
+#if CONFIG_SIM_LINK_DROP_SEC > 0
+static StaticTimer_t s_link_timer_buf;
+static TimerHandle_t s_link_timer;
+#endif
+
+int64_t hal_ranging_echo_us(int64_t *edge_us)
+{
+    *edge_us = esp_timer_get_time();
+    // Returned at once rather than after the echo time, so simulations run at full speed
+    return sim_tank_echo_us(&s_tank, *edge_us, settings_current()->tank_height_cm);
+}
+
+#if CONFIG_SIM_LINK_DROP_SEC > 0
+/* Alternates CONFIG_SIM_LINK_DROP_SEC up with CONFIG_SIM_LINK_DOWN_SEC down, to
+ * exercise the reconnect path */
+static void link_timer_cb(TimerHandle_t timer)
+{
+    s_link_up = !s_link_up;
+    ESP_LOGW(TAG, "Simulated link %s", s_link_up ? "restored" : "dropped");
+    xTimerChangePeriod(timer, pdMS_TO_TICKS((s_link_up ? CONFIG_SIM_LINK_DROP_SEC
+                                                       : CONFIG_SIM_LINK_DOWN_SEC) * 1000), 0);
+    if (!s_link_up) {
+        s_net_handler(HAL_NET_DISCONNECTED);
+    }
+}
+#endif
+
+void hal_net_start(hal_net_handler_t handler)
+{
+    s_net_handler = handler;
+
+#if CONFIG_SIM_LINK_DROP_SEC > 0
+    s_link_timer = xTimerCreateStatic("sim_link", pdMS_TO_TICKS(CONFIG_SIM_LINK_DROP_SEC * 1000),
+                                      pdFALSE, NULL, link_timer_cb, &s_link_timer_buf);
+    xTimerStart(s_link_timer, portMAX_DELAY);
+#endif
+
+    ESP_LOGI(TAG, "Using the host network");
+    s_net_handler(HAL_NET_STARTED);
+}
+
+void hal_net_connect(void)
+{
+    s_net_handler(s_link_up ? HAL_NET_GOT_IP : HAL_NET_DISCONNECTED);
+}
+
+esp_err_t hal_net_rssi(int8_t *rssi)
+{
+    if (!s_link_up) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    *rssi = -50;
+    return ESP_OK;
+}
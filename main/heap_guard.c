@@ -0,0 +1,84 @@
+/* Heap use at start-up and after it */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#if CONFIG_HEAP_GUARD_ENABLE
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_sys.h"
+#endif
+#include "heap_guard.h"
+
+static const char *TAG = "HEAP_GUARD";
+
+static uint32_t s_boot_free = 0;
+static size_t s_boot_peak = 0;
+
+/* Written before the guard is armed, read-only afterwards */
+static TaskHandle_t s_tasks[HEAP_GUARD_MAX_TASKS];
+static size_t s_task_count = 0;
+static volatile bool s_armed = false;
+
+void heap_guard_boot_start(void)
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    s_boot_free = esp_get_free_heap_size();
+#endif
+}
+
+void heap_guard_watch_task(TaskHandle_t task)
+{
+    if (task != NULL && s_task_count < HEAP_GUARD_MAX_TASKS) {
+        s_tasks[s_task_count++] = task;
+    }
+}
+
+void heap_guard_init_done(void)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    // The host's heap is not the one the firmware will run with
+    return;
+#else
+    uint32_t min_free = esp_get_minimum_free_heap_size();
+
+    s_boot_peak = s_boot_free > min_free ? s_boot_free - min_free : 0;
+    ESP_LOGI(TAG, "Start-up used at most %u bytes of heap, %lu bytes free",
+             s_boot_peak, esp_get_free_heap_size());
+
+#if CONFIG_HEAP_GUARD_ENABLE
+    s_armed = true;
+    ESP_LOGI(TAG, "Guarding %u tasks against heap allocation", s_task_count);
+#endif
+#endif
+}
+
+size_t heap_guard_boot_peak_bytes(void)
+{
+    return s_boot_peak;
+}
+
+#if CONFIG_HEAP_GUARD_ENABLE
+/* Called by the heap after every allocation (CONFIG_HEAP_USE_HOOKS). Must not
+ * allocate itself, so it reports through the ROM printf. */
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    if (!s_armed) {
+        return;
+    }
+
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    for (size_t i = 0; i < s_task_count; i++) {
+        if (s_tasks[i] == current) {
+            esp_rom_printf("%s: task %s allocated %u bytes after start-up\n",
+                           TAG, pcTaskGetName(current), size);
+            abort();
+        }
+    }
+}
+
+void IRAM_ATTR esp_heap_trace_free_hook(void *ptr)
+{
+}
+#endif
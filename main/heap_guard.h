@@ -0,0 +1,32 @@
+/* Heap use at start-up and after it
+ *
+ * The application's tasks, queues, event groups and buffers are all statically
+ * allocated, so once start-up is complete its own code never allocates; Wi-Fi,
+ * lwIP, esp-mqtt and the HTTP server still manage their own memory. This module
+ * measures how much heap start-up took and, with CONFIG_HEAP_GUARD_ENABLE, aborts
+ * with the task name on any allocation made by a guarded task after
+ * heap_guard_init_done(), so a regression fails on the bench instead of
+ * fragmenting the heap over months in the field.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define HEAP_GUARD_MAX_TASKS 4
+
+/* Call first thing in app_main() */
+void heap_guard_boot_start(void);
+
+/* Abort on heap allocations made by this task after start-up (CONFIG_HEAP_GUARD_ENABLE).
+ * Only for tasks that never call into code that allocates, e.g. the network stack. */
+void heap_guard_watch_task(TaskHandle_t task);
+
+/* Call at the end of app_main(): logs and keeps the peak heap used by start-up,
+ * and arms the guard */
+void heap_guard_init_done(void);
+
+/* Heap used by start-up at its peak, 0 before heap_guard_init_done() */
+size_t heap_guard_boot_peak_bytes(void);
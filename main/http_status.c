@@ -0,0 +1,331 @@
+/* HTTP status server */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_app_desc.h"
+#include "http_status.h"
+#include "hal.h"
+#include "metrics.h"
+#include "publisher.h"
+#include "sample_ring.h"
+#include "heap_guard.h"
+#include "time_sync.h"
+#if CONFIG_SENSOR_STREAM_ENABLE
+#include <unistd.h>
+#include "stream.h"
+#endif
+
+static const char *TAG = "HTTP_STATUS";
+
+static reconnect_t *s_wifi;
+static reconnect_t *s_mqtt;
+
+/* Response text is collected in a small buffer and sent in chunks, so the size of
+ * the exposition does not dictate the size of any allocation */
+typedef struct {
+    httpd_req_t *req;
+    char buf[512];
+    size_t len;
+    esp_err_t err;
+} out_t;
+
+static void out_flush(out_t *out)
+{
+    if (out->len > 0 && out->err == ESP_OK) {
+        out->err = httpd_resp_send_chunk(out->req, out->buf, out->len);
+    }
+    out->len = 0;
+}
+
+static void out_printf(out_t *out, const char *fmt, ...)
+{
+    va_list args;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t room = sizeof(out->buf) - out->len;
+        va_start(args, fmt);
+        int n = vsnprintf(out->buf + out->len, room, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < room) {
+            out->len += n;
+            return;
+        }
+        // Did not fit: send what we have and format again into the empty buffer
+        out_flush(out);
+    }
+    ESP_LOGW(TAG, "Dropped oversized line");
+}
+
+static esp_err_t out_finish(out_t *out)
+{
+    out_flush(out);
+    if (out->err == ESP_OK) {
+        out->err = httpd_resp_send_chunk(out->req, NULL, 0);
+    }
+    return out->err;
+}
+
+static void metric_header(out_t *out, const char *name, const char *type, const char *help)
+{
+    out_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static bool wifi_rssi(int *rssi)
+{
+    int8_t value;
+
+    if (hal_net_rssi(&value) != ESP_OK) {
+        return false;
+    }
+    *rssi = value;
+    return true;
+}
+
+static void write_reading_metrics(out_t *out)
+{
+    metrics_t m;
+    metrics_get(&m);
+
+    if (m.have_reading) {
+        metric_header(out, "salt_distance_cm", "gauge", "Latest distance from the sensor to the salt.");
+        out_printf(out, "salt_distance_cm %.1f\n", m.last_reading.distance_cm);
+        metric_header(out, "salt_level_percent", "gauge", "Latest salt level.");
+        out_printf(out, "salt_level_percent %.1f\n", m.last_reading.percentage);
+        metric_header(out, "salt_reading_timestamp_seconds", "gauge", "Wall-clock time of the latest reading.");
+        out_printf(out, "salt_reading_timestamp_seconds %lld\n", m.last_reading.timestamp_us / 1000000);
+    }
+
+    metric_header(out, "salt_readings_total", "counter", "Sensor readings taken.");
+    out_printf(out, "salt_readings_total %lu\n", m.readings);
+    metric_header(out, "salt_reading_errors_total", "counter", "Readings that timed out waiting for an echo.");
+    out_printf(out, "salt_reading_errors_total %lu\n", m.read_errors);
+
+    metric_header(out, "salt_reading_duration_seconds", "histogram", "Time taken by one sensor reading.");
+    uint32_t cumulative = 0;
+    for (size_t i = 0; i < METRICS_LATENCY_BUCKETS - 1; i++) {
+        cumulative += m.latency_buckets[i];
+        out_printf(out, "salt_reading_duration_seconds_bucket{le=\"%.3f\"} %lu\n",
+                   metrics_latency_bounds_us[i] / 1e6, cumulative);
+    }
+    cumulative += m.latency_buckets[METRICS_LATENCY_BUCKETS - 1];
+    out_printf(out, "salt_reading_duration_seconds_bucket{le=\"+Inf\"} %lu\n", cumulative);
+    out_printf(out, "salt_reading_duration_seconds_sum %.6f\n", m.latency_sum_us / 1e6);
+    out_printf(out, "salt_reading_duration_seconds_count %lu\n", cumulative);
+
+    metric_header(out, "salt_sampling_deadlines_total", "counter", "Readings taken at a sampling deadline.");
+    out_printf(out, "salt_sampling_deadlines_total %lu\n", m.deadlines);
+    metric_header(out, "salt_sampling_missed_deadlines_total", "counter",
+                  "Sampling deadlines skipped because the sensor task ran late.");
+    out_printf(out, "salt_sampling_missed_deadlines_total %lu\n", m.missed_deadlines);
+    metric_header(out, "salt_sampling_lateness_seconds_total", "counter",
+                  "Total time readings started behind their deadline.");
+    out_printf(out, "salt_sampling_lateness_seconds_total %.6f\n", m.lateness_sum_us / 1e6);
+    metric_header(out, "salt_sampling_lateness_max_seconds", "gauge",
+                  "Largest time a reading started behind its deadline.");
+    out_printf(out, "salt_sampling_lateness_max_seconds %.6f\n", m.lateness_max_us / 1e6);
+
+    sample_ring_stats_t ring;
+    sample_ring_get_stats(&ring);
+    metric_header(out, "salt_sample_ring_overruns_total", "counter",
+                  "Readings dropped because the publish task fell behind.");
+    out_printf(out, "salt_sample_ring_overruns_total %lu\n", ring.overruns);
+    metric_header(out, "salt_sample_ring_high_water", "gauge",
+                  "Most readings waiting for the publish task at once.");
+    out_printf(out, "salt_sample_ring_high_water %lu\n", ring.high_water);
+}
+
+static void write_mqtt_metrics(out_t *out)
+{
+    publisher_stats_t stats;
+    publisher_get_stats(&stats);
+
+    metric_header(out, "salt_mqtt_published_total", "counter", "MQTT messages handed to the client.");
+    for (int i = 0; i < PUB_CLASS_COUNT; i++) {
+        out_printf(out, "salt_mqtt_published_total{class=\"%s\"} %lu\n",
+                   publisher_class_name(i), stats.published[i]);
+    }
+    metric_header(out, "salt_mqtt_refused_total", "counter",
+                  "MQTT messages refused to stay within the outbox limit.");
+    for (int i = 0; i < PUB_CLASS_COUNT; i++) {
+        out_printf(out, "salt_mqtt_refused_total{class=\"%s\"} %lu\n",
+                   publisher_class_name(i), stats.refused[i]);
+    }
+    metric_header(out, "salt_mqtt_outbox_bytes", "gauge", "Memory held by unacknowledged MQTT messages.");
+    out_printf(out, "salt_mqtt_outbox_bytes %d\n", stats.outbox_bytes);
+    metric_header(out, "salt_mqtt_outbox_messages", "gauge", "MQTT messages waiting for an acknowledgement.");
+    out_printf(out, "salt_mqtt_outbox_messages %lu\n", stats.outbox_depth);
+}
+
+static void write_link_metrics(out_t *out)
+{
+    reconnect_stats_t wifi;
+    reconnect_stats_t mqtt;
+
+    reconnect_get_stats(s_wifi, &wifi);
+    reconnect_get_stats(s_mqtt, &mqtt);
+
+    metric_header(out, "salt_link_up", "gauge", "Whether the link is connected.");
+    out_printf(out, "salt_link_up{link=\"wifi\"} %d\n", wifi.connected);
+    out_printf(out, "salt_link_up{link=\"mqtt\"} %d\n", mqtt.connected);
+    metric_header(out, "salt_link_reconnects_total", "counter", "Successful connections after an outage.");
+    out_printf(out, "salt_link_reconnects_total{link=\"wifi\"} %lu\n", wifi.reconnects);
+    out_printf(out, "salt_link_reconnects_total{link=\"mqtt\"} %lu\n", mqtt.reconnects);
+    metric_header(out, "salt_link_outage_seconds_total", "counter",
+                  "Time spent disconnected after first connecting.");
+    out_printf(out, "salt_link_outage_seconds_total{link=\"wifi\"} %.3f\n",
+               (wifi.total_outage_ms + wifi.current_outage_ms) / 1e3);
+    out_printf(out, "salt_link_outage_seconds_total{link=\"mqtt\"} %.3f\n",
+               (mqtt.total_outage_ms + mqtt.current_outage_ms) / 1e3);
+
+    int rssi;
+    if (wifi_rssi(&rssi)) {
+        metric_header(out, "salt_wifi_rssi_dbm", "gauge", "Signal strength of the access point.");
+        out_printf(out, "salt_wifi_rssi_dbm %d\n", rssi);
+    }
+}
+
+static void write_time_metrics(out_t *out)
+{
+    time_sync_stats_t stats;
+
+    time_sync_get_stats(&stats);
+    metric_header(out, "salt_time_valid", "gauge", "1 if the wall clock is set.");
+    out_printf(out, "salt_time_valid %d\n", stats.valid ? 1 : 0);
+    metric_header(out, "salt_time_syncs_total", "counter", "SNTP synchronizations since boot.");
+    out_printf(out, "salt_time_syncs_total %lu\n", stats.syncs);
+    if (stats.syncs > 0) {
+        metric_header(out, "salt_time_offset_seconds", "gauge",
+                      "Server minus local time at the last SNTP sync.");
+        out_printf(out, "salt_time_offset_seconds %.6f\n", stats.offset_us / 1e6);
+        metric_header(out, "salt_time_last_sync_timestamp_seconds", "gauge",
+                      "Wall-clock time of the last SNTP sync.");
+        out_printf(out, "salt_time_last_sync_timestamp_seconds %lld\n", stats.last_sync_us / 1000000);
+    }
+    if (stats.have_drift) {
+        metric_header(out, "salt_time_drift_ppm", "gauge",
+                      "Local clock rate error between the last two SNTP syncs.");
+        out_printf(out, "salt_time_drift_ppm %.1f\n", stats.drift_ppm);
+    }
+}
+
+static void write_system_metrics(out_t *out)
+{
+    metrics_task_t tasks[METRICS_MAX_TASKS];
+    size_t task_count = metrics_get_tasks(tasks, METRICS_MAX_TASKS);
+
+    metric_header(out, "salt_heap_free_bytes", "gauge", "Free heap.");
+    out_printf(out, "salt_heap_free_bytes %lu\n", esp_get_free_heap_size());
+    metric_header(out, "salt_heap_min_free_bytes", "gauge", "Lowest free heap since boot.");
+    out_printf(out, "salt_heap_min_free_bytes %lu\n", esp_get_minimum_free_heap_size());
+    metric_header(out, "salt_heap_boot_peak_bytes", "gauge", "Most heap used during start-up.");
+    out_printf(out, "salt_heap_boot_peak_bytes %u\n", heap_guard_boot_peak_bytes());
+
+    metric_header(out, "salt_task_stack_free_bytes", "gauge",
+                  "Least free stack a task has had since it started.");
+    for (size_t i = 0; i < task_count; i++) {
+        out_printf(out, "salt_task_stack_free_bytes{task=\"%s\"} %u\n",
+                   tasks[i].name, uxTaskGetStackHighWaterMark(tasks[i].handle));
+    }
+
+    metric_header(out, "salt_uptime_seconds", "counter", "Time since boot.");
+    out_printf(out, "salt_uptime_seconds %lld\n", esp_timer_get_time() / 1000000);
+}
+
+static esp_err_t metrics_handler(httpd_req_t *req)
+{
+    static out_t out;       // Requests are handled one at a time by the server task
+
+    out = (out_t) { .req = req };
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    write_reading_metrics(&out);
+    write_mqtt_metrics(&out);
+    write_link_metrics(&out);
+    write_time_metrics(&out);
+    write_system_metrics(&out);
+    return out_finish(&out);
+}
+
+static esp_err_t status_handler(httpd_req_t *req)
+{
+    static out_t out;
+    metrics_t m;
+    reconnect_stats_t wifi;
+    reconnect_stats_t mqtt;
+    int rssi = 0;
+
+    metrics_get(&m);
+    reconnect_get_stats(s_wifi, &wifi);
+    reconnect_get_stats(s_mqtt, &mqtt);
+    bool have_rssi = wifi_rssi(&rssi);
+
+    out = (out_t) { .req = req };
+    httpd_resp_set_type(req, "application/json");
+    out_printf(&out, "{\"firmware\":\"%s\",\"uptime_s\":%lld,",
+               esp_app_get_description()->version, esp_timer_get_time() / 1000000);
+    if (m.have_reading) {
+        out_printf(&out, "\"distance\":%.1f,\"percentage\":%.1f,\"timestamp\":%lld,",
+                   m.last_reading.distance_cm, m.last_reading.percentage,
+                   m.last_reading.timestamp_us / 1000000);
+    }
+    out_printf(&out, "\"readings\":%lu,\"read_errors\":%lu,", m.readings, m.read_errors);
+    out_printf(&out, "\"wifi\":{\"connected\":%s,\"reconnects\":%lu",
+               wifi.connected ? "true" : "false", wifi.reconnects);
+    if (have_rssi) {
+        out_printf(&out, ",\"rssi\":%d", rssi);
+    }
+    out_printf(&out, "},\"mqtt\":{\"connected\":%s,\"reconnects\":%lu},",
+               mqtt.connected ? "true" : "false", mqtt.reconnects);
+    out_printf(&out, "\"heap_free\":%lu,\"heap_min_free\":%lu}",
+               esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+    return out_finish(&out);
+}
+
+#if CONFIG_SENSOR_STREAM_ENABLE
+/* With a close_fn set the server leaves closing the socket to us */
+static void session_closed(httpd_handle_t server, int sockfd)
+{
+    stream_session_closed(sockfd);
+    close(sockfd);
+}
+#endif
+
+esp_err_t http_status_start(reconnect_t *wifi, reconnect_t *mqtt)
+{
+    httpd_handle_t server = NULL;
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+
+    s_wifi = wifi;
+    s_mqtt = mqtt;
+    config.server_port = CONFIG_HTTP_STATUS_PORT;
+#if CONFIG_SENSOR_STREAM_ENABLE
+    config.close_fn = session_closed;
+#endif
+
+    esp_err_t err = httpd_start(&server, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start HTTP server: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    const httpd_uri_t uris[] = {
+        { .uri = "/metrics", .method = HTTP_GET, .handler = metrics_handler },
+        { .uri = "/status", .method = HTTP_GET, .handler = status_handler },
+    };
+    for (size_t i = 0; i < sizeof(uris) / sizeof(uris[0]); i++) {
+        httpd_register_uri_handler(server, &uris[i]);
+    }
+#if CONFIG_SENSOR_STREAM_ENABLE
+    stream_register(server);
+#endif
+
+    ESP_LOGI(TAG, "Serving /metrics and /status on port %d", CONFIG_HTTP_STATUS_PORT);
+    return ESP_OK;
+}
@@ -0,0 +1,18 @@
+/* HTTP status server
+ *
+ * Serves the device's health on the local network, so a monitoring system can
+ * scrape it directly instead of routing diagnostics through the MQTT broker:
+ *
+ *   GET /metrics   Prometheus text exposition format
+ *   GET /status    JSON summary
+ *   WS  /stream    live sensor samples (CONFIG_SENSOR_STREAM_ENABLE, see stream.h)
+ */
+
+#pragma once
+
+#include "esp_err.h"
+#include "reconnect.h"
+
+/* Start the server on CONFIG_HTTP_STATUS_PORT. The reconnect instances provide the
+ * link statistics and must outlive the server. */
+esp_err_t http_status_start(reconnect_t *wifi, reconnect_t *mqtt);
@@ -0,0 +1,23 @@
+/* JSON encoding of a reading for the state topic */
+
+#include "json_writer.h"
+#include "time_sync.h"
+#include "json_state.h"
+
+size_t json_state_encode(char *buf, size_t size, const reading_t *reading)
+{
+    json_writer_t w;
+
+    json_writer_init(&w, buf, size);
+    json_write_literal(&w, "{\"distance\":");
+    json_write_float1(&w, reading->distance_cm);
+    json_write_literal(&w, ",\"percentage\":");
+    json_write_float1(&w, reading->percentage);
+    if (time_sync_timestamp_valid(reading->timestamp_us)) {
+        json_write_literal(&w, ",\"timestamp_us\":");
+        json_write_int(&w, reading->timestamp_us);
+    }
+    json_write_literal(&w, "}");
+
+    return json_writer_finish(&w) != NULL ? w.len : 0;
+}
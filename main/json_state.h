@@ -0,0 +1,19 @@
+/* JSON encoding of a reading for the state topic
+ *
+ *   {"distance":23.4,"percentage":76.6,"timestamp_us":1735689600000000}
+ *
+ * This is what the Home Assistant entities read through their value templates.
+ * "timestamp_us" is the capture time and is left out for a reading taken before
+ * the clock was set.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "reading.h"
+
+/* Worst-case encoded size */
+#define JSON_STATE_MAX_LEN 96
+
+/* Encode a reading into buf. Returns the length, or 0 if it does not fit. */
+size_t json_state_encode(char *buf, size_t size, const reading_t *reading);
@@ -0,0 +1,108 @@
+/* Minimal allocation-free JSON serializer */
+
+#include <string.h>
+#include "json_writer.h"
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size)
+{
+    *w = (json_writer_t) {
+        .buf = buf,
+        .size = size,
+    };
+}
+
+void json_write_raw(json_writer_t *w, const char *str, size_t len)
+{
+    // Keep one byte back for the terminator added by json_writer_finish()
+    if (w->overflow || w->size - w->len <= len) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, str, len);
+    w->len += len;
+}
+
+static void write_char(json_writer_t *w, char c)
+{
+    json_write_raw(w, &c, 1);
+}
+
+/* Digits of 'value', zero-padded to at least min_digits */
+static void write_uint(json_writer_t *w, uint64_t value, unsigned min_digits)
+{
+    char digits[20];
+    unsigned n = 0;
+
+    do {
+        digits[sizeof(digits) - 1 - n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0 || n < min_digits);
+
+    json_write_raw(w, digits + sizeof(digits) - n, n);
+}
+
+static uint64_t magnitude(int64_t value)
+{
+    return value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+}
+
+void json_write_int(json_writer_t *w, int64_t value)
+{
+    if (value < 0) {
+        write_char(w, '-');
+    }
+    write_uint(w, magnitude(value), 1);
+}
+
+void json_write_fixed(json_writer_t *w, int64_t value, unsigned decimals)
+{
+    uint64_t scale = 1;
+    for (unsigned i = 0; i < decimals; i++) {
+        scale *= 10;
+    }
+
+    uint64_t abs = magnitude(value);
+    if (value < 0) {
+        write_char(w, '-');
+    }
+    write_uint(w, abs / scale, 1);
+    if (decimals > 0) {
+        write_char(w, '.');
+        write_uint(w, abs % scale, decimals);
+    }
+}
+
+void json_write_float1(json_writer_t *w, float value)
+{
+    float scaled = value * 10.0f;
+    json_write_fixed(w, (int64_t)(scaled + (scaled >= 0 ? 0.5f : -0.5f)), 1);
+}
+
+void json_write_string(json_writer_t *w, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    write_char(w, '"');
+    for (const char *p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\') {
+            write_char(w, '\\');
+            write_char(w, (char)c);
+        } else if (c < 0x20) {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            json_write_raw(w, esc, sizeof(esc));
+        } else {
+            write_char(w, (char)c);
+        }
+    }
+    write_char(w, '"');
+}
+
+const char *json_writer_finish(json_writer_t *w)
+{
+    if (w->overflow || w->size == 0) {
+        return NULL;
+    }
+    w->buf[w->len] = '\0';
+    return w->buf;
+}
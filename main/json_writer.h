@@ -0,0 +1,44 @@
+/* Minimal allocation-free JSON serializer
+ *
+ * Appends to a caller-supplied buffer. Constant fragments are copied verbatim and
+ * numbers are written as fixed-point integers, so building a payload needs neither
+ * the heap nor printf's float formatting. Overflow is sticky: once the buffer is
+ * full every further write is dropped and json_writer_finish() returns NULL.
+ *
+ * Plain C with no ESP-IDF dependencies, so it also builds for the Linux host target.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size);
+
+/* Append bytes verbatim (no quoting or escaping) */
+void json_write_raw(json_writer_t *w, const char *str, size_t len);
+
+/* Append a string literal; its length is known at compile time */
+#define json_write_literal(w, lit) json_write_raw((w), (lit), sizeof(lit) - 1)
+
+void json_write_int(json_writer_t *w, int64_t value);
+
+/* Append value / 10^decimals, e.g. (435, 1) -> 43.5 and (-10, 1) -> -1.0 */
+void json_write_fixed(json_writer_t *w, int64_t value, unsigned decimals);
+
+/* Append a float rounded to one decimal place */
+void json_write_float1(json_writer_t *w, float value);
+
+/* Append a quoted string, escaping quotes, backslashes and control characters */
+void json_write_string(json_writer_t *w, const char *str);
+
+/* NUL-terminate the output. Returns the buffer, or NULL if anything was dropped. */
+const char *json_writer_finish(json_writer_t *w);
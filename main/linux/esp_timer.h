@@ -0,0 +1,45 @@
+/* esp_timer for the linux target
+ *
+ * ESP-IDF does not build esp_timer for the linux target. This is the subset the
+ * application uses, with the same names and semantics: a monotonic microsecond
+ * clock that starts at zero when the program starts, and one-shot timers whose
+ * callbacks run in a task (here the FreeRTOS timer task). Only on the include path
+ * of linux builds.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+/* Timers that can exist at once; the application needs one per reconnecting link */
+#define ESP_TIMER_LINUX_MAX 4
+
+typedef struct esp_timer *esp_timer_handle_t;
+
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+/* Microseconds since the program started */
+int64_t esp_timer_get_time(void);
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
+                           esp_timer_handle_t *out_handle);
+
+/* ESP_ERR_INVALID_STATE if the timer is already running */
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+
+/* ESP_ERR_INVALID_STATE if the timer is not running */
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
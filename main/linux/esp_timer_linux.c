@@ -0,0 +1,84 @@
+/* esp_timer for the linux target, on top of FreeRTOS software timers */
+
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_timer.h"
+
+struct esp_timer {
+    StaticTimer_t buf;
+    TimerHandle_t handle;
+    esp_timer_cb_t callback;
+    void *arg;
+};
+
+static struct esp_timer s_timers[ESP_TIMER_LINUX_MAX];
+static size_t s_timer_count = 0;
+static int64_t s_start_us = 0;
+
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Runs before app_main(), so the clock starts with the program like it does at boot */
+__attribute__((constructor)) static void esp_timer_linux_init(void)
+{
+    s_start_us = monotonic_us();
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return monotonic_us() - s_start_us;
+}
+
+static void timer_cb(TimerHandle_t handle)
+{
+    struct esp_timer *timer = pvTimerGetTimerID(handle);
+    timer->callback(timer->arg);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
+                           esp_timer_handle_t *out_handle)
+{
+    if (create_args == NULL || create_args->callback == NULL || out_handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_timer_count >= ESP_TIMER_LINUX_MAX) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    struct esp_timer *timer = &s_timers[s_timer_count++];
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    // The period is replaced on every start; FreeRTOS only requires it to be non-zero
+    timer->handle = xTimerCreateStatic(create_args->name ? create_args->name : "esp_timer", 1,
+                                       pdFALSE, timer, timer_cb, &timer->buf);
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (xTimerIsTimerActive(timer->handle)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Rounded up: a timer must never fire early
+    TickType_t ticks = (timeout_us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    // Changing the period also starts a dormant timer
+    return xTimerChangePeriod(timer->handle, ticks, portMAX_DELAY) == pdPASS ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!xTimerIsTimerActive(timer->handle)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return xTimerStop(timer->handle, portMAX_DELAY) == pdPASS ? ESP_OK : ESP_FAIL;
+}
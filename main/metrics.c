@@ -0,0 +1,72 @@
+/* Sensor metrics */
+
+#include <stddef.h>
+#include "metrics.h"
+
+const uint32_t metrics_latency_bounds_us[METRICS_LATENCY_BUCKETS - 1] = METRICS_LATENCY_BOUNDS_US;
+
+static metrics_t s_metrics;
+static metrics_task_t s_tasks[METRICS_MAX_TASKS];
+static size_t s_task_count = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void metrics_record_reading(const reading_t *reading, int64_t latency_us)
+{
+    size_t bucket = 0;
+    while (bucket < METRICS_LATENCY_BUCKETS - 1 && latency_us > metrics_latency_bounds_us[bucket]) {
+        bucket++;
+    }
+
+    taskENTER_CRITICAL(&s_lock);
+    s_metrics.readings++;
+    if (reading->distance_cm < 0) {
+        s_metrics.read_errors++;
+    } else {
+        s_metrics.have_reading = true;
+        s_metrics.last_reading = *reading;
+    }
+    s_metrics.latency_buckets[bucket]++;
+    s_metrics.latency_sum_us += latency_us;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void metrics_record_deadline(int64_t lateness_us, uint32_t missed)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_metrics.deadlines++;
+    s_metrics.missed_deadlines += missed;
+    s_metrics.lateness_sum_us += lateness_us;
+    if (lateness_us > s_metrics.lateness_max_us) {
+        s_metrics.lateness_max_us = lateness_us;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void metrics_get(metrics_t *metrics)
+{
+    taskENTER_CRITICAL(&s_lock);
+    *metrics = s_metrics;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void metrics_register_task(TaskHandle_t handle, const char *name)
+{
+    taskENTER_CRITICAL(&s_lock);
+    if (handle != NULL && s_task_count < METRICS_MAX_TASKS) {
+        s_tasks[s_task_count++] = (metrics_task_t) { handle, name };
+    }
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+size_t metrics_get_tasks(metrics_task_t *tasks, size_t max)
+{
+    size_t count;
+
+    taskENTER_CRITICAL(&s_lock);
+    count = s_task_count < max ? s_task_count : max;
+    for (size_t i = 0; i < count; i++) {
+        tasks[i] = s_tasks[i];
+    }
+    taskEXIT_CRITICAL(&s_lock);
+    return count;
+}
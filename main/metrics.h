@@ -0,0 +1,60 @@
+/* Sensor metrics
+ *
+ * Running counters about the sensor itself: the latest good reading, how many readings
+ * failed and how long each one took, how closely readings kept to their sampling
+ * deadlines, plus the tasks whose stack usage should be reported. Link and publish
+ * statistics live in reconnect.c and publisher.c; the status server combines all
+ * of them.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "reading.h"
+
+/* Upper bounds of the reading latency histogram buckets in microseconds; one more
+ * bucket counts everything slower. An HC-SR04 echo takes up to ~25 ms, a timeout
+ * ~40 ms. */
+#define METRICS_LATENCY_BOUNDS_US { 1000, 2000, 5000, 10000, 20000, 50000, 100000 }
+#define METRICS_LATENCY_BUCKETS   8
+
+#define METRICS_MAX_TASKS 4
+
+typedef struct {
+    bool have_reading;
+    reading_t last_reading;
+    uint32_t readings;
+    uint32_t read_errors;
+    uint32_t latency_buckets[METRICS_LATENCY_BUCKETS];  // Per bucket, not cumulative
+    int64_t latency_sum_us;
+    uint32_t deadlines;         // Readings taken at a sampling deadline
+    uint32_t missed_deadlines;  // Deadlines skipped entirely because the task ran late
+    int64_t lateness_sum_us;    // Wake-up time behind the deadline, summed
+    int64_t lateness_max_us;
+} metrics_t;
+
+typedef struct {
+    TaskHandle_t handle;
+    const char *name;
+} metrics_task_t;
+
+extern const uint32_t metrics_latency_bounds_us[METRICS_LATENCY_BUCKETS - 1];
+
+/* Record one reading and how long the measurement took */
+void metrics_record_reading(const reading_t *reading, int64_t latency_us);
+
+/* Record a reading taken lateness_us after its sampling deadline, with missed
+ * deadlines that passed without a reading before it */
+void metrics_record_deadline(int64_t lateness_us, uint32_t missed);
+
+void metrics_get(metrics_t *metrics);
+
+/* Report this task's stack high-water mark. Call once per task after creating it. */
+void metrics_register_task(TaskHandle_t handle, const char *name);
+
+/* Registered tasks; returns how many were copied to tasks[] */
+size_t metrics_get_tasks(metrics_task_t *tasks, size_t max);
@@ -0,0 +1,276 @@
+/* Flash-backed store-and-forward queue
+ *
+ * The partition is used as a circular log of fixed 32-byte records. Records are
+ * only ever appended and a sector is erased just before the write head enters
+ * it, so every sector sees the same number of erase cycles. Each record carries
+ * a sequence number and a CRC, which lets the queue be rebuilt after a power
+ * loss: a half-written record fails its CRC and is skipped. Delivered records
+ * are marked by clearing their "pending" word in place, which NOR flash allows
+ * without an erase.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "offline_queue.h"
+
+static const char *TAG = "OFFLINE_QUEUE";
+
+#define RECORD_MAGIC        0x53414C54  // "SALT"
+#define RECORD_PENDING      0xFFFFFFFF
+#define SECTOR_SIZE         4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    reading_t reading;
+    uint32_t crc;       // Covers magic, seq and reading
+    uint32_t pending;   // RECORD_PENDING until delivered, then cleared to 0
+} record_t;
+
+_Static_assert(sizeof(record_t) == 32, "record_t must stay 32 bytes");
+_Static_assert(SECTOR_SIZE % sizeof(record_t) == 0, "records must not straddle sectors");
+
+#define RECORDS_PER_SECTOR  (SECTOR_SIZE / sizeof(record_t))
+
+static const esp_partition_t *s_partition = NULL;
+static SemaphoreHandle_t s_lock = NULL;
+static StaticSemaphore_t s_lock_buf;
+static uint32_t s_slots = 0;        // Total record slots in the partition
+static uint32_t s_head = 0;         // Next slot to write
+static uint32_t s_tail = 0;         // Oldest pending slot, valid while s_pending > 0
+static uint32_t s_next_seq = 0;
+static uint32_t s_pending = 0;
+static uint32_t s_dropped = 0;
+
+static uint32_t record_crc(const record_t *rec)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)rec, offsetof(record_t, crc));
+}
+
+static bool read_slot(uint32_t slot, record_t *rec)
+{
+    return esp_partition_read(s_partition, slot * sizeof(record_t), rec, sizeof(*rec)) == ESP_OK;
+}
+
+static bool slot_pending(uint32_t slot)
+{
+    record_t rec;
+    return read_slot(slot, &rec) && rec.magic == RECORD_MAGIC &&
+           rec.crc == record_crc(&rec) && rec.pending == RECORD_PENDING;
+}
+
+static bool slot_erased(uint32_t slot)
+{
+    record_t rec;
+    if (!read_slot(slot, &rec)) {
+        return false;
+    }
+    const uint8_t *bytes = (const uint8_t *)&rec;
+    for (size_t i = 0; i < sizeof(rec); i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Sequence numbers wrap, so compare them as a signed distance */
+static bool seq_after(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) > 0;
+}
+
+/* First pending slot at or after 'slot', stopping at the write head */
+static uint32_t next_pending(uint32_t slot)
+{
+    while (slot != s_head && !slot_pending(slot)) {
+        slot = (slot + 1) % s_slots;
+    }
+    return slot;
+}
+
+/* Erase the sector the write head is entering. Any undelivered readings in it
+ * are the oldest in the queue, so they are the ones dropped. */
+static esp_err_t erase_head_sector(void)
+{
+    uint32_t first = s_head;
+    uint32_t last = s_head + RECORDS_PER_SECTOR;
+
+    if (s_pending > 0 && s_tail >= first && s_tail < last) {
+        for (uint32_t slot = s_tail; slot < last; slot++) {
+            if (slot_pending(slot)) {
+                s_pending--;
+                s_dropped++;
+            }
+        }
+        ESP_LOGW(TAG, "Queue full, dropped oldest readings (%" PRIu32 " dropped so far)", s_dropped);
+        if (s_pending > 0) {
+            s_tail = next_pending(last % s_slots);
+        }
+    }
+
+    return esp_partition_erase_range(s_partition, first * sizeof(record_t), SECTOR_SIZE);
+}
+
+esp_err_t offline_queue_init(void)
+{
+    s_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                           CONFIG_OFFLINE_QUEUE_PARTITION_LABEL);
+    if (s_partition == NULL) {
+        ESP_LOGE(TAG, "Partition '%s' not found, offline readings will be lost",
+                 CONFIG_OFFLINE_QUEUE_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // The ring needs one sector to erase while another still holds data
+    s_slots = (s_partition->size / SECTOR_SIZE) * RECORDS_PER_SECTOR;
+    if (s_slots < 2 * RECORDS_PER_SECTOR) {
+        ESP_LOGE(TAG, "Partition '%s' too small, need at least %d bytes",
+                 CONFIG_OFFLINE_QUEUE_PARTITION_LABEL, 2 * SECTOR_SIZE);
+        s_partition = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    s_lock = xSemaphoreCreateMutexStatic(&s_lock_buf);
+
+    // Rebuild the positions: the newest record gives the write head, the
+    // oldest undelivered record gives the read tail
+    bool have_newest = false;
+    bool have_oldest = false;
+    uint32_t newest_seq = 0;
+    uint32_t oldest_seq = 0;
+    record_t rec;
+
+    for (uint32_t slot = 0; slot < s_slots; slot++) {
+        if (!read_slot(slot, &rec) || rec.magic != RECORD_MAGIC || rec.crc != record_crc(&rec)) {
+            continue;
+        }
+        if (!have_newest || seq_after(rec.seq, newest_seq)) {
+            have_newest = true;
+            newest_seq = rec.seq;
+            s_head = (slot + 1) % s_slots;
+        }
+        if (rec.pending == RECORD_PENDING) {
+            if (!have_oldest || seq_after(oldest_seq, rec.seq)) {
+                have_oldest = true;
+                oldest_seq = rec.seq;
+                s_tail = slot;
+            }
+            s_pending++;
+        }
+    }
+
+    s_next_seq = have_newest ? newest_seq + 1 : 0;
+
+    // A write interrupted by power loss leaves a dirty slot after the newest
+    // valid record. Skip ahead to a clean slot or to the next sector boundary,
+    // where the sector gets erased before use anyway.
+    while (s_head % RECORDS_PER_SECTOR != 0 && !slot_erased(s_head)) {
+        s_head = (s_head + 1) % s_slots;
+    }
+
+    ESP_LOGI(TAG, "Offline queue ready: %" PRIu32 " slots, %" PRIu32 " pending", s_slots, s_pending);
+    return ESP_OK;
+}
+
+esp_err_t offline_queue_push(const reading_t *reading)
+{
+    if (s_partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    esp_err_t err = ESP_OK;
+    if (s_head % RECORDS_PER_SECTOR == 0) {
+        err = erase_head_sector();
+    }
+
+    if (err == ESP_OK) {
+        record_t rec = {
+            .magic = RECORD_MAGIC,
+            .seq = s_next_seq,
+            .reading = *reading,
+            .pending = RECORD_PENDING,
+        };
+        rec.crc = record_crc(&rec);
+
+        err = esp_partition_write(s_partition, s_head * sizeof(record_t), &rec, sizeof(rec));
+        if (err == ESP_OK) {
+            if (s_pending == 0) {
+                s_tail = s_head;
+            }
+            s_pending++;
+            s_next_seq++;
+        }
+        // Move on even after a failed write so a worn slot is not retried forever
+        s_head = (s_head + 1) % s_slots;
+    }
+
+    xSemaphoreGive(s_lock);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store reading: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t offline_queue_peek(reading_t *reading)
+{
+    if (s_partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (s_pending > 0) {
+        record_t rec;
+        err = esp_partition_read(s_partition, s_tail * sizeof(record_t), &rec, sizeof(rec));
+        if (err == ESP_OK) {
+            *reading = rec.reading;
+        }
+    }
+
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+esp_err_t offline_queue_pop(void)
+{
+    if (s_partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    if (s_pending > 0) {
+        static const uint32_t delivered = 0;
+        err = esp_partition_write(s_partition, s_tail * sizeof(record_t) + offsetof(record_t, pending),
+                                  &delivered, sizeof(delivered));
+        // If the mark fails the reading is replayed again after a reboot,
+        // which is preferable to wedging the queue on it now
+        s_pending--;
+        s_tail = next_pending((s_tail + 1) % s_slots);
+    }
+
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+uint32_t offline_queue_count(void)
+{
+    return s_pending;
+}
+
+uint32_t offline_queue_dropped(void)
+{
+    return s_dropped;
+}
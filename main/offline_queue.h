@@ -0,0 +1,33 @@
+/* Flash-backed store-and-forward queue
+ *
+ * Readings taken while the broker is unreachable are appended to a dedicated
+ * flash partition and replayed in order once the connection comes back. They are
+ * stored with their timestamp as taken, so whether the clock was set at the time
+ * is still known on replay, after a reboot too (see time_sync_timestamp_valid()).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "reading.h"
+
+/* Locate the queue partition and rebuild the read/write positions from flash */
+esp_err_t offline_queue_init(void);
+
+/* Append a reading. When the queue is full the oldest sector is dropped. */
+esp_err_t offline_queue_push(const reading_t *reading);
+
+/* Copy the oldest pending reading without removing it.
+ * Returns ESP_ERR_NOT_FOUND when the queue is empty. */
+esp_err_t offline_queue_peek(reading_t *reading);
+
+/* Mark the oldest pending reading (the one returned by peek) as delivered */
+esp_err_t offline_queue_pop(void);
+
+/* Number of readings waiting to be replayed */
+uint32_t offline_queue_count(void);
+
+/* Number of readings lost because the queue wrapped onto undelivered data */
+uint32_t offline_queue_dropped(void);
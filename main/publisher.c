@@ -0,0 +1,388 @@
+/* Publishing with per-class delivery policy */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "publisher.h"
+#include "topics.h"
+#if CONFIG_MQTT5_ENABLE
+#include "esp_app_desc.h"
+#endif
+
+static const char *TAG = "PUBLISHER";
+
+/* Unset Kconfig bools are left undefined, so map the retain options to values */
+#if CONFIG_PUB_STATE_RETAIN
+#define STATE_RETAIN true
+#else
+#define STATE_RETAIN false
+#endif
+#if CONFIG_PUB_EVENT_RETAIN
+#define EVENT_RETAIN true
+#else
+#define EVENT_RETAIN false
+#endif
+#if CONFIG_PUB_DIAGNOSTIC_RETAIN
+#define DIAGNOSTIC_RETAIN true
+#else
+#define DIAGNOSTIC_RETAIN false
+#endif
+#if CONFIG_PUB_BATCH_RETAIN
+#define BATCH_RETAIN true
+#else
+#define BATCH_RETAIN false
+#endif
+
+typedef struct {
+    int qos;
+    bool retain;
+    uint8_t outbox_pct;         // Share of the outbox limit this class may fill
+    const char *name;
+} pub_policy_t;
+
+static const pub_policy_t s_policies[PUB_CLASS_COUNT] = {
+    [PUB_CLASS_STATE] = {
+        CONFIG_PUB_STATE_QOS, STATE_RETAIN, CONFIG_PUB_STATE_OUTBOX_PCT, "state"
+    },
+    [PUB_CLASS_EVENT] = {
+        CONFIG_PUB_EVENT_QOS, EVENT_RETAIN, CONFIG_PUB_EVENT_OUTBOX_PCT, "event"
+    },
+    [PUB_CLASS_DIAGNOSTIC] = {
+        CONFIG_PUB_DIAGNOSTIC_QOS, DIAGNOSTIC_RETAIN, CONFIG_PUB_DIAGNOSTIC_OUTBOX_PCT,
+        "diagnostic"
+    },
+    [PUB_CLASS_BATCH] = {
+        CONFIG_PUB_BATCH_QOS, BATCH_RETAIN, CONFIG_PUB_BATCH_OUTBOX_PCT, "batch"
+    },
+};
+
+typedef struct {
+    const char *name;
+    pub_class_t cls;
+} pub_topic_info_t;
+
+static const pub_topic_info_t s_topics[PUB_TOPIC_COUNT] = {
+    [PUB_TOPIC_STATE] = { STATE_TOPIC, PUB_CLASS_STATE },
+    [PUB_TOPIC_STATE_CBOR] = { STATE_CBOR_TOPIC, PUB_CLASS_STATE },
+    [PUB_TOPIC_BATCH] = { BATCH_TOPIC, PUB_CLASS_BATCH },
+    [PUB_TOPIC_BATCH_CBOR] = { BATCH_CBOR_TOPIC, PUB_CLASS_BATCH },
+    [PUB_TOPIC_HISTORY] = { HISTORY_TOPIC, PUB_CLASS_BATCH },
+    [PUB_TOPIC_AVAILABILITY] = { AVAILABILITY_TOPIC, PUB_CLASS_EVENT },
+    [PUB_TOPIC_SETTINGS] = { SETTINGS_TOPIC, PUB_CLASS_EVENT },
+    [PUB_TOPIC_DISTANCE_CONFIG] = { DISTANCE_CONFIG_TOPIC, PUB_CLASS_EVENT },
+    [PUB_TOPIC_PERCENTAGE_CONFIG] = { PERCENTAGE_CONFIG_TOPIC, PUB_CLASS_EVENT },
+    [PUB_TOPIC_CONNECTIVITY] = { CONNECTIVITY_TOPIC, PUB_CLASS_DIAGNOSTIC },
+    [PUB_TOPIC_DIAGNOSTICS] = { DIAGNOSTICS_TOPIC, PUB_CLASS_DIAGNOSTIC },
+    [PUB_TOPIC_BENCHMARK] = { BENCHMARK_TOPIC, PUB_CLASS_DIAGNOSTIC },
+};
+
+static esp_mqtt_client_handle_t s_client = NULL;
+
+/* Publishes come from several tasks, so the counters are shared */
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static int32_t s_outbox_depth = 0;
+static uint32_t s_published[PUB_CLASS_COUNT];
+static uint32_t s_refused[PUB_CLASS_COUNT];
+
+#if CONFIG_MQTT5_ENABLE
+static bool s_v5 = false;
+static uint32_t s_seq = 0;
+
+/* Alias state of the current session, under s_lock. s_session counts sessions so
+ * a publish that straddles one does not mark an alias as sent in the next.
+ *
+ * esp-mqtt does not pass on the broker's Topic Alias Maximum from the CONNACK. It
+ * checks each alias against it when the properties are set, so a session starts
+ * with no known limit and s_alias_max drops below the first alias that is refused. */
+#define ALIAS_MAX_UNKNOWN UINT16_MAX
+
+static uint32_t s_session = 0;
+static uint16_t s_alias_max = 0;
+static bool s_alias_sent[PUB_TOPIC_COUNT];
+
+/* esp-mqtt keeps the publish properties for whichever publish comes next, so
+ * setting them and publishing must not interleave between tasks. s_v5_mutex
+ * covers both, together with the alias bookkeeping.
+ *
+ * The event handler runs in the MQTT task while esp-mqtt holds its own lock, so
+ * it cannot wait for s_v5_mutex: the holder may be waiting for that lock. When
+ * the mutex is taken the handler publishes without an alias, which its own lock
+ * keeps atomic, and then restores the properties of the interrupted publish,
+ * kept in s_pending. */
+static SemaphoreHandle_t s_v5_mutex;
+static StaticSemaphore_t s_v5_mutex_buf;
+static TaskHandle_t s_mqtt_task = NULL;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t expiry;
+    uint16_t alias;
+} v5_props_t;
+
+static v5_props_t s_pending;
+static bool s_pending_valid = false;
+
+static esp_err_t set_properties(const v5_props_t *p)
+{
+    char seq[11];
+    snprintf(seq, sizeof(seq), "%" PRIu32, p->seq);
+
+    esp_mqtt5_user_property_item_t items[] = {
+        { "fw", esp_app_get_description()->version },
+        { "seq", seq },
+    };
+
+    esp_mqtt5_publish_property_config_t props = {
+        .message_expiry_interval = p->expiry,
+        .topic_alias = p->alias,
+    };
+    if (esp_mqtt5_client_set_user_property(&props.user_property, items,
+                                           sizeof(items) / sizeof(items[0])) != ESP_OK) {
+        props.user_property = NULL;
+    }
+    // The properties apply to the next publish only; esp-mqtt copies the user properties
+    esp_err_t err = esp_mqtt5_client_set_publish_property(s_client, &props);
+    esp_mqtt5_client_delete_user_property(props.user_property);
+    return err;
+}
+
+static v5_props_t next_properties(bool retain)
+{
+    v5_props_t p = {
+        // A retained message (availability, discovery) must outlive any expiry
+        .expiry = retain ? 0 : CONFIG_MQTT5_MESSAGE_EXPIRY_SEC,
+    };
+    taskENTER_CRITICAL(&s_lock);
+    p.seq = ++s_seq;
+    taskEXIT_CRITICAL(&s_lock);
+    return p;
+}
+
+/* Event handler publish while another task holds s_v5_mutex */
+static int publish_v5_from_handler(const char *name, const char *data, int len, int qos,
+                                   bool retain)
+{
+    v5_props_t p = next_properties(retain);
+    set_properties(&p);
+    int msg_id = esp_mqtt_client_publish(s_client, name, data, len, qos, retain);
+
+    v5_props_t pending;
+    taskENTER_CRITICAL(&s_lock);
+    bool restore = s_pending_valid;
+    pending = s_pending;
+    taskEXIT_CRITICAL(&s_lock);
+    // If the holder had not set its properties yet it sets them again anyway, and if
+    // it had already published, the next publish overwrites them
+    if (restore) {
+        set_properties(&pending);
+    }
+    return msg_id;
+}
+
+/* Called with s_v5_mutex held */
+static int publish_v5_locked(pub_topic_t topic, const char *name, const char *data, int len,
+                             int qos, bool retain)
+{
+    v5_props_t p = next_properties(retain);
+    bool alias_only = false;
+
+    // Aliases are only used for QoS 0: esp-mqtt may resend QoS 1 messages on a
+    // later connection, where an alias-only topic would no longer be defined.
+    // The session can end in the handler meanwhile, hence the lock.
+    taskENTER_CRITICAL(&s_lock);
+    uint32_t session = s_session;
+#if CONFIG_MQTT5_TOPIC_ALIASES
+    if (qos == 0 && topic < PUB_TOPIC_COUNT && topic + 1 <= s_alias_max) {
+        p.alias = topic + 1;
+        // Once the broker has seen the topic with its alias, the alias alone is enough
+        alias_only = s_alias_sent[topic];
+    }
+#endif
+    s_pending = p;
+    s_pending_valid = true;
+    taskEXIT_CRITICAL(&s_lock);
+
+    esp_err_t err = set_properties(&p);
+    if (err != ESP_OK && p.alias != 0) {
+        // esp-mqtt refuses an alias above the broker's Topic Alias Maximum here and
+        // keeps none of the properties. This alias and any higher one then stay
+        // unused for the session, and the message goes out with its full topic.
+        ESP_LOGW(TAG, "Topic alias %u rejected, using lower aliases only", p.alias);
+        taskENTER_CRITICAL(&s_lock);
+        if (session == s_session && p.alias - 1 < s_alias_max) {
+            s_alias_max = p.alias - 1;
+        }
+        p.alias = 0;
+        alias_only = false;
+        s_pending = p;
+        taskEXIT_CRITICAL(&s_lock);
+        err = set_properties(&p);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "MQTT 5 properties not set: %s", esp_err_to_name(err));
+    }
+    int msg_id = esp_mqtt_client_publish(s_client, alias_only ? "" : name, data, len, qos, retain);
+
+    taskENTER_CRITICAL(&s_lock);
+    if (p.alias != 0 && msg_id >= 0 && session == s_session) {
+        s_alias_sent[topic] = true;
+    }
+    s_pending_valid = false;
+    taskEXIT_CRITICAL(&s_lock);
+    return msg_id;
+}
+
+/* topic is PUB_TOPIC_COUNT for topics only known at runtime, which get no alias */
+static int publish_v5(pub_topic_t topic, const char *name, const char *data, int len, int qos,
+                      bool retain)
+{
+    if (xTaskGetCurrentTaskHandle() == s_mqtt_task) {
+        if (xSemaphoreTake(s_v5_mutex, 0) != pdTRUE) {
+            return publish_v5_from_handler(name, data, len, qos, retain);
+        }
+    } else {
+        xSemaphoreTake(s_v5_mutex, portMAX_DELAY);
+    }
+    int msg_id = publish_v5_locked(topic, name, data, len, qos, retain);
+    xSemaphoreGive(s_v5_mutex);
+    return msg_id;
+}
+#endif
+
+void publisher_init(esp_mqtt_client_handle_t client)
+{
+    s_client = client;
+#if CONFIG_MQTT5_ENABLE
+    s_v5_mutex = xSemaphoreCreateMutexStatic(&s_v5_mutex_buf);
+#endif
+}
+
+#if CONFIG_MQTT5_ENABLE
+static void reset_aliases(uint16_t alias_max)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_session++;
+    s_alias_max = alias_max;
+    for (int i = 0; i < PUB_TOPIC_COUNT; i++) {
+        s_alias_sent[i] = false;
+    }
+    taskEXIT_CRITICAL(&s_lock);
+}
+#endif
+
+void publisher_connected(esp_mqtt_protocol_ver_t protocol_ver)
+{
+#if CONFIG_MQTT5_ENABLE
+    // Only the event handler calls this, so it identifies the MQTT task
+    s_mqtt_task = xTaskGetCurrentTaskHandle();
+    s_v5 = (protocol_ver == MQTT_PROTOCOL_V_5);
+    reset_aliases(s_v5 ? ALIAS_MAX_UNKNOWN : 0);
+#endif
+}
+
+void publisher_disconnected(void)
+{
+#if CONFIG_MQTT5_ENABLE
+    // A publish started while disconnected must not pick an alias of the old session
+    reset_aliases(0);
+#endif
+}
+
+void publisher_message_done(void)
+{
+    taskENTER_CRITICAL(&s_lock);
+    s_outbox_depth--;
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+/* QoS 0 messages are sent straight away and never wait in the outbox, so only
+ * acknowledged messages are held to the class's share of the limit */
+static bool outbox_admits(const pub_policy_t *policy, int len)
+{
+#if CONFIG_MQTT_OUTBOX_LIMIT_KB > 0
+    if (policy->qos == 0) {
+        return true;
+    }
+    int limit = CONFIG_MQTT_OUTBOX_LIMIT_KB * 1024 * policy->outbox_pct / 100;
+    return esp_mqtt_client_get_outbox_size(s_client) + len <= limit;
+#else
+    return true;
+#endif
+}
+
+static int publish(pub_topic_t topic, const char *name, pub_class_t cls, const char *data, int len)
+{
+    const pub_policy_t *policy = &s_policies[cls];
+    int msg_id;
+
+    if (len == 0) {
+        len = strlen(data);
+    }
+
+    if (!outbox_admits(policy, len)) {
+        msg_id = PUB_REFUSED;
+    } else {
+#if CONFIG_MQTT5_ENABLE
+        if (s_v5) {
+            msg_id = publish_v5(topic, name, data, len, policy->qos, policy->retain);
+        } else
+#endif
+        {
+            msg_id = esp_mqtt_client_publish(s_client, name, data, len, policy->qos, policy->retain);
+        }
+    }
+
+    taskENTER_CRITICAL(&s_lock);
+    if (msg_id == PUB_REFUSED) {
+        s_refused[cls]++;
+    } else if (msg_id >= 0) {
+        s_published[cls]++;
+        if (msg_id > 0) {
+            s_outbox_depth++;
+        }
+    }
+    taskEXIT_CRITICAL(&s_lock);
+
+    if (msg_id == PUB_REFUSED) {
+        ESP_LOGW(TAG, "Outbox full, dropped %s message to %s", policy->name, name);
+    }
+    return msg_id;
+}
+
+int publisher_publish(pub_topic_t topic, const char *data, int len)
+{
+    return publish(topic, s_topics[topic].name, s_topics[topic].cls, data, len);
+}
+
+int publisher_publish_to(const char *topic, pub_class_t cls, const char *data, int len)
+{
+    return publish(PUB_TOPIC_COUNT, topic, cls, data, len);
+}
+
+const char *publisher_topic_name(pub_topic_t topic)
+{
+    return s_topics[topic].name;
+}
+
+void publisher_get_stats(publisher_stats_t *stats)
+{
+    stats->outbox_bytes = s_client != NULL ? esp_mqtt_client_get_outbox_size(s_client) : 0;
+
+    taskENTER_CRITICAL(&s_lock);
+    // An acknowledgement can be processed before the publish that caused it is counted
+    stats->outbox_depth = s_outbox_depth > 0 ? (uint32_t)s_outbox_depth : 0;
+    for (int i = 0; i < PUB_CLASS_COUNT; i++) {
+        stats->published[i] = s_published[i];
+        stats->refused[i] = s_refused[i];
+    }
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+const char *publisher_class_name(pub_class_t cls)
+{
+    return s_policies[cls].name;
+}
@@ -0,0 +1,82 @@
+/* Publishing with per-class delivery policy
+ *
+ * Every message the device publishes goes through here. Each topic belongs to a
+ * message class (state, events, diagnostics, batches), and the class decides the
+ * QoS, the retain flag and how much of the outbox it may fill. When the outbox
+ * gets close to CONFIG_MQTT_OUTBOX_LIMIT_KB, lower-priority classes are refused
+ * first, so a backlog of diagnostics never crowds out state updates. Refused
+ * messages are counted per class.
+ *
+ * On an MQTT 5 session, messages also carry a message expiry, user properties
+ * (firmware version and a sequence number) and, for QoS 0, a topic alias instead
+ * of the full topic string. On an MQTT 3.1.1 session they are published unchanged.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mqtt_client.h"
+
+typedef enum {
+    PUB_CLASS_STATE,
+    PUB_CLASS_EVENT,            // Availability, settings replies and discovery
+    PUB_CLASS_DIAGNOSTIC,
+    PUB_CLASS_BATCH,            // Batches and replayed offline readings
+    PUB_CLASS_COUNT,
+} pub_class_t;
+
+typedef enum {
+    PUB_TOPIC_STATE,
+    PUB_TOPIC_STATE_CBOR,
+    PUB_TOPIC_BATCH,
+    PUB_TOPIC_BATCH_CBOR,
+    PUB_TOPIC_HISTORY,
+    PUB_TOPIC_AVAILABILITY,
+    PUB_TOPIC_SETTINGS,
+    PUB_TOPIC_DISTANCE_CONFIG,
+    PUB_TOPIC_PERCENTAGE_CONFIG,
+    PUB_TOPIC_CONNECTIVITY,
+    PUB_TOPIC_DIAGNOSTICS,
+    PUB_TOPIC_BENCHMARK,
+    PUB_TOPIC_COUNT,
+} pub_topic_t;
+
+/* Publish result when the message was refused to protect the outbox; matches the
+ * value esp_mqtt_client_publish() returns when its own outbox limit is hit */
+#define PUB_REFUSED (-2)
+
+typedef struct {
+    int outbox_bytes;           // Bytes held by the esp-mqtt outbox
+    uint32_t outbox_depth;      // Messages waiting for an acknowledgement
+    uint32_t published[PUB_CLASS_COUNT];
+    uint32_t refused[PUB_CLASS_COUNT];
+} publisher_stats_t;
+
+void publisher_init(esp_mqtt_client_handle_t client);
+
+/* Call on MQTT_EVENT_CONNECTED. Topic aliases only live as long as a network
+ * connection, so they are re-established on every new session. */
+void publisher_connected(esp_mqtt_protocol_ver_t protocol_ver);
+
+/* Call on MQTT_EVENT_DISCONNECTED */
+void publisher_disconnected(void);
+
+/* Call on MQTT_EVENT_PUBLISHED and MQTT_EVENT_DELETED: the message left the outbox */
+void publisher_message_done(void);
+
+/* Publish to one of the device's topics with its class policy.
+ * Returns the esp-mqtt message id, or a negative value on failure. */
+int publisher_publish(pub_topic_t topic, const char *data, int len);
+
+/* Publish to a topic built at runtime (e.g. per ESP-NOW node) with a class policy.
+ * Such topics never use MQTT 5 topic aliases. */
+int publisher_publish_to(const char *topic, pub_class_t cls, const char *data, int len);
+
+/* Topic string of a publisher topic */
+const char *publisher_topic_name(pub_topic_t topic);
+
+void publisher_get_stats(publisher_stats_t *stats);
+
+/* Short lowercase name of a class, as used in exported statistics */
+const char *publisher_class_name(pub_class_t cls);
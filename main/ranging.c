@@ -0,0 +1,74 @@
+/* Ranging math */
+
+#include <inttypes.h>
+#include "esp_log.h"
+#include "hal.h"
+#include "ranging.h"
+
+static const char *TAG = "RANGING";
+
+float ranging_distance_cm(int64_t pulse_duration, bool verbose)
+{
+    if (pulse_duration == ECHO_NO_START) {
+        if (verbose) {
+            ESP_LOGW(TAG, "HC-SR04 timeout waiting for echo start");
+        }
+        return -1.0f;
+    }
+    if (pulse_duration == ECHO_NO_END) {
+        if (verbose) {
+            ESP_LOGW(TAG, "HC-SR04 timeout waiting for echo end");
+        }
+        return -1.0f;
+    }
+
+    // Calculate distance: speed of sound is 343 m/s or 0.0343 cm/us
+    // Distance = (pulse_duration * 0.0343) / 2
+    float distance = (pulse_duration * 0.0343f) / 2.0f;
+
+    // No float formatting here: newlib allocates for it, and the sensor task must
+    // not touch the heap (see heap_guard.h). The publish task logs the distance.
+    if (verbose) {
+        ESP_LOGI(TAG, "HC-SR04 echo: %" PRId64 " us", pulse_duration);
+    }
+
+    // Sanity check: HC-SR04 range is 2cm to 400cm
+    if (distance < 2.0f || distance > 400.0f) {
+        if (verbose) {
+            ESP_LOGW(TAG, "Distance out of range (echo %" PRId64 " us)", pulse_duration);
+        }
+        return -1.0f;
+    }
+
+    return distance;
+}
+
+float ranging_percentage(float distance_cm, const settings_t *settings)
+{
+    float tank_height = (float)settings->tank_height_cm;
+
+    // Distance is measured from top, so we need to invert it
+    // If distance is small (near top), tank is nearly full
+    // If distance is large (near bottom), tank is nearly empty
+    float salt_height = tank_height - distance_cm;
+    float percentage = (salt_height / tank_height) * 100.0f;
+
+    // Clamp between 0 and 100
+    if (percentage < 0) percentage = 0;
+    if (percentage > 100) percentage = 100;
+
+    return percentage;
+}
+
+bool ranging_make_reading(int64_t echo_us, int64_t timestamp_us, const settings_t *settings,
+                          bool verbose, reading_t *reading)
+{
+    reading->timestamp_us = timestamp_us;
+    reading->distance_cm = ranging_distance_cm(echo_us, verbose);
+    if (reading->distance_cm < 0) {
+        reading->percentage = 0.0f;
+        return false;
+    }
+    reading->percentage = ranging_percentage(reading->distance_cm, settings);
+    return true;
+}
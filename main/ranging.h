@@ -0,0 +1,28 @@
+/* Ranging math
+ *
+ * Turns an HC-SR04 echo into a distance and a distance into a fill level. Shared
+ * by the device's sensor task and, on the linux target, the virtual fleet, so both
+ * report exactly what a real unit would.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "reading.h"
+#include "settings.h"
+
+/* Convert an echo (as returned by hal_ranging_echo_us()) to a distance, or -1.0f
+ * if there was no usable echo. Stream samples pass verbose = false so a 20 Hz
+ * stream does not flood the log. */
+float ranging_distance_cm(int64_t echo_us, bool verbose);
+
+/* Salt level in percent, 0-100, from a valid (non-negative) distance */
+float ranging_percentage(float distance_cm, const settings_t *settings);
+
+/* Turn an echo captured at timestamp_us into a reading. Returns false if there was
+ * no usable echo: the reading then has a distance of -1.0f and a percentage of 0,
+ * for the read error count, and must not be published, since clamped it would
+ * show a full tank. */
+bool ranging_make_reading(int64_t echo_us, int64_t timestamp_us, const settings_t *settings,
+                          bool verbose, reading_t *reading);
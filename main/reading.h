@@ -0,0 +1,13 @@
+/* A single salt level reading, shared by the queueing, batching and encoding code */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    // Wall-clock capture time, microseconds since the epoch. Taken before the clock
+    // was set it is time since boot, which time_sync_timestamp_valid() tells apart.
+    int64_t timestamp_us;
+    float distance_cm;
+    float percentage;
+} reading_t;
@@ -0,0 +1,108 @@
+/* Reconnection with exponential backoff and jitter */
+
+#include <inttypes.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "reconnect.h"
+
+static const char *TAG = "RECONNECT";
+
+/* Capped exponential backoff with "equal jitter": half of the delay is fixed so
+ * retries never bunch up at zero, the other half is random so devices that lost
+ * the link at the same moment drift apart. */
+static uint32_t backoff_delay_ms(uint32_t attempt)
+{
+    uint32_t delay = CONFIG_RECONNECT_BACKOFF_MIN_MS;
+    while (attempt > 1 && delay < CONFIG_RECONNECT_BACKOFF_MAX_MS) {
+        delay *= 2;
+        attempt--;
+    }
+    if (delay > CONFIG_RECONNECT_BACKOFF_MAX_MS) {
+        delay = CONFIG_RECONNECT_BACKOFF_MAX_MS;
+    }
+
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+static void retry_timer_cb(void *arg)
+{
+    reconnect_t *rc = arg;
+
+    ESP_LOGI(TAG, "%s: reconnect attempt %" PRIu32, rc->name, rc->stats.attempts);
+    rc->connect();
+}
+
+esp_err_t reconnect_init(reconnect_t *rc, const char *name, void (*connect)(void))
+{
+    *rc = (reconnect_t) {
+        .name = name,
+        .connect = connect,
+        .lock = portMUX_INITIALIZER_UNLOCKED,
+    };
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = retry_timer_cb,
+        .arg = rc,
+        .name = name,
+    };
+    return esp_timer_create(&timer_args, &rc->timer);
+}
+
+void reconnect_connected(reconnect_t *rc)
+{
+    int64_t now = esp_timer_get_time();
+
+    esp_timer_stop(rc->timer);
+
+    taskENTER_CRITICAL(&rc->lock);
+    bool was_outage = rc->ever_connected && !rc->stats.connected;
+    int64_t outage_ms = (now - rc->outage_start_us) / 1000;
+    if (was_outage) {
+        rc->stats.reconnects++;
+        rc->stats.last_outage_ms = outage_ms;
+        rc->stats.total_outage_ms += outage_ms;
+        if (outage_ms > rc->stats.longest_outage_ms) {
+            rc->stats.longest_outage_ms = outage_ms;
+        }
+    }
+    rc->ever_connected = true;
+    rc->stats.connected = true;
+    rc->stats.attempts = 0;
+    taskEXIT_CRITICAL(&rc->lock);
+
+    if (was_outage) {
+        ESP_LOGI(TAG, "%s: reconnected after %" PRId64 " ms (reconnect #%" PRIu32 ")",
+                 rc->name, outage_ms, rc->stats.reconnects);
+    }
+}
+
+void reconnect_disconnected(reconnect_t *rc)
+{
+    taskENTER_CRITICAL(&rc->lock);
+    if (rc->stats.connected) {
+        rc->outage_start_us = esp_timer_get_time();
+        rc->stats.connected = false;
+    }
+    uint32_t attempt = ++rc->stats.attempts;
+    taskEXIT_CRITICAL(&rc->lock);
+
+    uint32_t delay_ms = backoff_delay_ms(attempt);
+
+    // A retry may already be pending if both an error and a disconnect were
+    // reported for the same attempt; keep the one already scheduled
+    if (esp_timer_start_once(rc->timer, (uint64_t)delay_ms * 1000) == ESP_OK) {
+        ESP_LOGI(TAG, "%s: disconnected, retrying in %" PRIu32 " ms", rc->name, delay_ms);
+    }
+}
+
+void reconnect_get_stats(reconnect_t *rc, reconnect_stats_t *stats)
+{
+    int64_t now = esp_timer_get_time();
+
+    taskENTER_CRITICAL(&rc->lock);
+    *stats = rc->stats;
+    if (rc->ever_connected && !rc->stats.connected) {
+        stats->current_outage_ms = (now - rc->outage_start_us) / 1000;
+    }
+    taskEXIT_CRITICAL(&rc->lock);
+}
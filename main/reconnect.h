@@ -0,0 +1,50 @@
+/* Reconnection with exponential backoff and jitter
+ *
+ * One instance tracks one link (Wi-Fi or MQTT). Every time the link drops or a
+ * connection attempt fails, the next attempt is scheduled after an exponentially
+ * growing, randomized delay, so a fleet recovering from the same outage spreads
+ * its reconnects out instead of hitting the AP and broker together. Retries never
+ * stop; the delay is capped at CONFIG_RECONNECT_BACKOFF_MAX_MS.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+/* Connection statistics exported for diagnostics */
+typedef struct {
+    bool connected;
+    uint32_t attempts;          // Attempts made in the current outage
+    uint32_t reconnects;        // Successful connections after an outage
+    int64_t current_outage_ms;  // Length of the ongoing outage, 0 when connected
+    int64_t last_outage_ms;
+    int64_t longest_outage_ms;
+    int64_t total_outage_ms;
+} reconnect_stats_t;
+
+/* Per-link state. Treat the fields as private. */
+typedef struct {
+    const char *name;
+    void (*connect)(void);
+    esp_timer_handle_t timer;
+    portMUX_TYPE lock;
+    bool ever_connected;
+    int64_t outage_start_us;
+    reconnect_stats_t stats;
+} reconnect_t;
+
+/* Set up a link. connect() is called from the esp_timer task when a retry is due. */
+esp_err_t reconnect_init(reconnect_t *rc, const char *name, void (*connect)(void));
+
+/* Report that the link came up: resets the backoff and closes the outage */
+void reconnect_connected(reconnect_t *rc);
+
+/* Report that the link dropped or an attempt failed: schedules the next attempt */
+void reconnect_disconnected(reconnect_t *rc);
+
+/* Snapshot the link statistics */
+void reconnect_get_stats(reconnect_t *rc, reconnect_stats_t *stats);
@@ -4,15 +4,15 @@
  * an HC-SR04 ultrasonic sensor and publishes the data to Home Assistant via MQTT.
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
-#include "esp_wifi.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 #include "esp_event.h"
-#include "esp_netif.h"
 #include "esp_log.h"
 #include "mqtt_client.h"
 #include "freertos/FreeRTOS.h"
@@ -20,88 +20,151 @@
 #include "freertos/semphr.h"
 #include "freertos/queue.h"
 #include "freertos/event_groups.h"
-#include "driver/gpio.h"
 #include "esp_timer.h"
+#if CONFIG_MQTT_TLS_CERT_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
+#include "hal.h"
+#include "ranging.h"
+#include "offline_queue.h"
+#include "reconnect.h"
+#include "cbor_state.h"
+#include "json_state.h"
+#include "discovery.h"
+#include "json_writer.h"
+#include "topics.h"
+#include "batch.h"
+#include "publisher.h"
+#include "settings.h"
+#include "metrics.h"
+#include "time_sync.h"
+#include "sample_ring.h"
+#include "heap_guard.h"
+#include "bench.h"
+#if CONFIG_DIAGNOSTICS_ENABLE
+#include "diagnostics.h"
+#endif
+#if CONFIG_HTTP_STATUS_ENABLE
+#include "http_status.h"
+#endif
+#if CONFIG_SENSOR_STREAM_ENABLE
+#include "stream.h"
+#endif
+#if CONFIG_DEVICE_ROLE_ESPNOW_NODE
+#include "espnow_node.h"
+#endif
+#if CONFIG_FLEET_SIM_ENABLE
+#include "fleet_sim.h"
+#endif
+#if CONFIG_DEVICE_ROLE_ESPNOW_GATEWAY
+#include "espnow_gateway.h"
+#endif
 
 static const char *TAG = "SALT_LEVEL";
 
 /* FreeRTOS event group to signal when we are connected*/
-static EventGroupHandle_t s_wifi_event_group;
+static EventGroupHandle_t s_conn_event_group;
+static StaticEventGroup_t s_conn_event_group_buf;
 
-/* The event group allows multiple bits for each event, but we only care about two events:
+/* The event group holds the connection state for every task that needs it:
  * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
+ * - the first CONFIG_WIFI_MAXIMUM_RETRY attempts failed, so boot continues offline
+ *   while reconnection carries on in the background
+ * - the MQTT session is up (set and cleared from mqtt_event_handler()) */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
+#define MQTT_CONNECTED_BIT BIT2
 
 static int s_retry_num = 0;
 static esp_mqtt_client_handle_t mqtt_client = NULL;
-static bool mqtt_connected = false;
-
-/* Wi-Fi event handler */
-static void event_handler(void* arg, esp_event_base_t event_base,
-                                int32_t event_id, void* event_data)
-{
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < CONFIG_WIFI_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "Retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-        }
+static TaskHandle_t s_sensor_task = NULL;
+static TaskHandle_t s_publish_task = NULL;
+
+/* Task stacks and control blocks are static, sized by CONFIG_*_TASK_STACK_SIZE */
+static StackType_t s_sensor_stack[CONFIG_SENSOR_TASK_STACK_SIZE];
+static StaticTask_t s_sensor_tcb;
+static StackType_t s_publish_stack[CONFIG_PUBLISH_TASK_STACK_SIZE];
+static StaticTask_t s_publish_tcb;
+
+/* Acquisition runs on the application core at high priority, so the busy-wait echo
+ * timing neither holds up nor is disturbed by Wi-Fi and lwIP on the protocol core.
+ * Publishing, which blocks on the network, stays on the protocol core. */
+#if CONFIG_FREERTOS_UNICORE
+#define SENSOR_TASK_CORE        0
+#else
+#define SENSOR_TASK_CORE        1
+#endif
+#define SENSOR_TASK_PRIORITY    10
+#define PUBLISH_TASK_CORE       0
+#define PUBLISH_TASK_PRIORITY   5
+
+/* Kept for the life of the client so it can be re-applied with esp_mqtt_set_config() */
+static esp_mqtt_client_config_t s_mqtt_cfg;
+
+/* Duration of the last and slowest MQTT connect (TCP, TLS for mqtts:// and CONNECT/CONNACK).
+ * Timed from MQTT_EVENT_BEFORE_CONNECT to MQTT_EVENT_CONNECTED. */
+static int64_t s_connect_start_us = 0;
+static int64_t s_connect_last_ms = -1;
+static int64_t s_connect_max_ms = -1;
+
+/* Broker resumed our persistent session on the last connect (MQTT_EVENT_CONNECTED) */
+static bool s_session_present = false;
+
+#define NVS_NAMESPACE           "salt_level"
+#define NVS_KEY_DISCOVERY_HASH  "disc_hash"
+
+/* Backoff state for each link, also the source of the exported connection statistics */
+static reconnect_t s_wifi_reconnect;
+static reconnect_t s_mqtt_reconnect;
+
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+/* How long a replayed reading may wait for its PUBACK before it is resent */
+#define REPLAY_ACK_TIMEOUT_MS 10000
+
+static TaskHandle_t s_replay_task = NULL;
+static StackType_t s_replay_stack[CONFIG_REPLAY_TASK_STACK_SIZE];
+static StaticTask_t s_replay_tcb;
+static volatile int s_last_acked_msg_id = -1;
+#endif
+
+static bool mqtt_is_connected(void)
+{
+    return (xEventGroupGetBits(s_conn_event_group) & MQTT_CONNECTED_BIT) != 0;
+}
+
+/* Network link event handler (see hal.h) */
+static void net_event_handler(hal_net_event_t event)
+{
+    if (event == HAL_NET_STARTED) {
+        hal_net_connect();
+    } else if (event == HAL_NET_DISCONNECTED) {
         ESP_LOGI(TAG,"Connect to the AP fail");
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
+        xEventGroupClearBits(s_conn_event_group, WIFI_CONNECTED_BIT);
+        if (++s_retry_num >= CONFIG_WIFI_MAXIMUM_RETRY) {
+            xEventGroupSetBits(s_conn_event_group, WIFI_FAIL_BIT);
+        }
+        // Never give up: keep retrying with backoff until the AP comes back
+        reconnect_disconnected(&s_wifi_reconnect);
+    } else if (event == HAL_NET_GOT_IP) {
         s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        reconnect_connected(&s_wifi_reconnect);
+        xEventGroupSetBits(s_conn_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
 /* Initialize Wi-Fi in station mode */
 void wifi_init_sta(void)
 {
-    s_wifi_event_group = xEventGroupCreate();
-
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &event_handler,
-                                                        NULL,
-                                                        &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                        IP_EVENT_STA_GOT_IP,
-                                                        &event_handler,
-                                                        NULL,
-                                                        &instance_got_ip));
-
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = CONFIG_WIFI_SSID,
-            .password = CONFIG_WIFI_PASSWORD,
-            .threshold.authmode = WIFI_AUTH_WPA2_PSK,
-        },
-    };
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
-    ESP_ERROR_CHECK(esp_wifi_start() );
+    s_conn_event_group = xEventGroupCreateStatic(&s_conn_event_group_buf);
+    ESP_ERROR_CHECK(reconnect_init(&s_wifi_reconnect, "wifi", hal_net_connect));
+
+    hal_net_start(net_event_handler);
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
 
     /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
      * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
+    EventBits_t bits = xEventGroupWaitBits(s_conn_event_group,
             WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
             pdFALSE,
             pdFALSE,
@@ -112,32 +175,211 @@ void wifi_init_sta(void)
     if (bits & WIFI_CONNECTED_BIT) {
         ESP_LOGI(TAG, "Connected to AP SSID:%s", CONFIG_WIFI_SSID);
     } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s", CONFIG_WIFI_SSID);
+        ESP_LOGI(TAG, "Failed to connect to SSID:%s, continuing offline and retrying", CONFIG_WIFI_SSID);
     } else {
         ESP_LOGE(TAG, "UNEXPECTED EVENT");
     }
 }
 
+static void publish_ha_discovery(bool force);
+static void discovery_message_acked(int msg_id);
+
+#if CONFIG_MQTT5_ENABLE
+/* Reason codes a broker may answer a version 5 CONNECT with when it only speaks
+ * 3.1.1: "unacceptable protocol version" (3.1.1 CONNACK) or "unsupported protocol
+ * version" (5.0 CONNACK). Brokers that just close the socket are caught by counting
+ * transport failures instead. */
+#define CONNACK_REFUSED_PROTOCOL_V311   0x01
+#define CONNACK_UNSUPPORTED_PROTOCOL_V5 0x84
+#define MQTT5_FALLBACK_FAILURES         3
+
+static int s_mqtt5_failures = 0;
+
+/* Switch to MQTT 3.1.1 for the rest of this boot; takes effect on the next attempt */
+static void mqtt_fallback_to_v311(const char *reason)
+{
+    if (s_mqtt_cfg.session.protocol_ver == MQTT_PROTOCOL_V_3_1_1) {
+        return;
+    }
+    ESP_LOGW(TAG, "Falling back to MQTT 3.1.1 (%s)", reason);
+    s_mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+    esp_mqtt_set_config(mqtt_client, &s_mqtt_cfg);
+}
+#endif
+
+static bool event_topic_is(esp_mqtt_event_handle_t event, const char *topic)
+{
+    return event->topic_len == (int)strlen(topic) &&
+           strncmp(event->topic, topic, event->topic_len) == 0;
+}
+
+/* Home Assistant publishes "online" here when it starts */
+static bool is_ha_birth_message(esp_mqtt_event_handle_t event)
+{
+    return event_topic_is(event, CONFIG_HA_STATUS_TOPIC) &&
+           event->data_len == 6 && strncmp(event->data, "online", 6) == 0;
+}
+
+#if CONFIG_REMOTE_SETTINGS_ENABLE
+/* Publish the settings in effect and the outcome of the last command (retained) */
+static void publish_settings(const char *status, const char *reason)
+{
+    static char payload[256];
+    json_writer_t w;
+
+    json_writer_init(&w, payload, sizeof(payload));
+    json_write_literal(&w, "{\"status\":");
+    json_write_string(&w, status);
+    if (reason != NULL) {
+        json_write_literal(&w, ",\"reason\":");
+        json_write_string(&w, reason);
+    }
+    json_write_literal(&w, ",\"settings\":");
+    settings_write_json(&w, settings_current());
+    json_write_literal(&w, "}");
+    if (json_writer_finish(&w) == NULL) {
+        ESP_LOGE(TAG, "Settings payload too large");
+        return;
+    }
+
+    publisher_publish(PUB_TOPIC_SETTINGS, payload, w.len);
+}
+
+/* Apply a config document from the settings command topic */
+static void handle_settings_command(esp_mqtt_event_handle_t event)
+{
+    char reason[64];
+
+    // Documents are tiny; one split across several events is not worth reassembling
+    if (event->current_data_offset != 0 || event->data_len != event->total_data_len) {
+        publish_settings("rejected", "document too large");
+        return;
+    }
+
+    if (settings_apply_json(event->data, event->data_len, reason, sizeof(reason)) != ESP_OK) {
+        publish_settings("rejected", reason);
+        return;
+    }
+    publish_settings("applied", NULL);
+
+    // Wake the sensor task so a new interval takes effect now, not after the old one
+    if (s_sensor_task != NULL) {
+        xTaskNotifyGive(s_sensor_task);
+    }
+}
+#endif
+
 /* MQTT event handler */
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     esp_mqtt_event_handle_t event = event_data;
 
     switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        s_connect_start_us = esp_timer_get_time();
+        break;
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        mqtt_connected = true;
+        if (s_connect_start_us != 0) {
+            s_connect_last_ms = (esp_timer_get_time() - s_connect_start_us) / 1000;
+            if (s_connect_last_ms > s_connect_max_ms) {
+                s_connect_max_ms = s_connect_last_ms;
+            }
+            ESP_LOGI(TAG, "MQTT connect took %" PRId64 " ms", s_connect_last_ms);
+        }
+        xEventGroupSetBits(s_conn_event_group, MQTT_CONNECTED_BIT);
+        reconnect_connected(&s_mqtt_reconnect);
+        s_session_present = event->session_present;
+        publisher_connected(event->protocol_ver);
+        ESP_LOGI(TAG, "MQTT protocol %s", event->protocol_ver == MQTT_PROTOCOL_V_5 ? "5.0" : "3.1.1");
+#if CONFIG_MQTT5_ENABLE
+        s_mqtt5_failures = 0;
+#endif
+        esp_mqtt_client_subscribe(mqtt_client, CONFIG_HA_STATUS_TOPIC, 1);
+#if CONFIG_REMOTE_SETTINGS_ENABLE
+        esp_mqtt_client_subscribe(mqtt_client, SETTINGS_SET_TOPIC, 1);
+        publish_settings("active", NULL);
+#endif
+        // Resend discovery on (re)connect unless the broker still holds it
+        publish_ha_discovery(false);
+        // Replaces the "offline" last will the broker may have published for us
+        publisher_publish(PUB_TOPIC_AVAILABILITY, AVAILABILITY_ONLINE, 0);
+#if CONFIG_DEVICE_ROLE_ESPNOW_GATEWAY
+        espnow_gateway_mqtt_connected();
+#endif
+        // Take a fresh reading now rather than waiting out the interval
+        if (s_sensor_task != NULL) {
+            xTaskNotifyGive(s_sensor_task);
+        }
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+        if (s_replay_task != NULL) {
+            xTaskNotifyGive(s_replay_task);
+        }
+#endif
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
-        mqtt_connected = false;
+        xEventGroupClearBits(s_conn_event_group, MQTT_CONNECTED_BIT);
+        reconnect_disconnected(&s_mqtt_reconnect);
+        publisher_disconnected();
+#if CONFIG_DEVICE_ROLE_ESPNOW_GATEWAY
+        espnow_gateway_mqtt_disconnected();
+#endif
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+        // Stop waiting for an acknowledgement that will not come
+        if (s_replay_task != NULL) {
+            xTaskNotifyGive(s_replay_task);
+        }
+#endif
+        break;
+    case MQTT_EVENT_DATA:
+        if (is_ha_birth_message(event)) {
+            ESP_LOGI(TAG, "Home Assistant came online, republishing discovery");
+            publish_ha_discovery(true);
+#if CONFIG_DEVICE_ROLE_ESPNOW_GATEWAY
+            espnow_gateway_mqtt_connected();
+#endif
+        }
+#if CONFIG_REMOTE_SETTINGS_ENABLE
+        if (event_topic_is(event, SETTINGS_SET_TOPIC)) {
+            handle_settings_command(event);
+        }
+#endif
+        break;
+    case MQTT_EVENT_DELETED:
+        // The outbox gave up on a message that was never acknowledged
+        ESP_LOGW(TAG, "MQTT message %d expired from the outbox", event->msg_id);
+        publisher_message_done();
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        publisher_message_done();
+        discovery_message_acked(event->msg_id);
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+        s_last_acked_msg_id = event->msg_id;
+        if (s_replay_task != NULL) {
+            xTaskNotifyGive(s_replay_task);
+        }
+#endif
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
         if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
             ESP_LOGE(TAG, "Last error code: 0x%x", event->error_handle->esp_transport_sock_errno);
+#if CONFIG_MQTT5_ENABLE
+            // Only count failures while the network is up, so plain outages don't trigger it
+            if ((xEventGroupGetBits(s_conn_event_group) & WIFI_CONNECTED_BIT) &&
+                ++s_mqtt5_failures >= MQTT5_FALLBACK_FAILURES) {
+                mqtt_fallback_to_v311("broker keeps dropping MQTT 5 connects");
+            }
+#endif
         } else if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
             ESP_LOGE(TAG, "Connection refused error: 0x%x", event->error_handle->connect_return_code);
+#if CONFIG_MQTT5_ENABLE
+            if (event->error_handle->connect_return_code == CONNACK_REFUSED_PROTOCOL_V311 ||
+                event->error_handle->connect_return_code == CONNACK_UNSUPPORTED_PROTOCOL_V5) {
+                mqtt_fallback_to_v311("protocol version refused");
+            }
+#endif
         }
         break;
     default:
@@ -145,215 +387,727 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     }
 }
 
+static void mqtt_connect(void)
+{
+    esp_mqtt_client_reconnect(mqtt_client);
+}
+
 /* Initialize MQTT client */
 static void mqtt_app_start(void)
 {
     ESP_LOGI(TAG, "=== MQTT Configuration ===");
     ESP_LOGI(TAG, "Broker URL: %s", CONFIG_MQTT_BROKER_URL);
     ESP_LOGI(TAG, "Client ID: %s", CONFIG_MQTT_CLIENT_ID);
-    ESP_LOGI(TAG, "Username: '%s' (length: %d)", CONFIG_MQTT_USERNAME, strlen(CONFIG_MQTT_USERNAME));
-    ESP_LOGI(TAG, "Password length: %d", strlen(CONFIG_MQTT_PASSWORD));
+    ESP_LOGI(TAG, "Username: '%s' (length: %zu)", CONFIG_MQTT_USERNAME, strlen(CONFIG_MQTT_USERNAME));
+    ESP_LOGI(TAG, "Password length: %zu", strlen(CONFIG_MQTT_PASSWORD));
     ESP_LOGI(TAG, "========================");
 
-    esp_mqtt_client_config_t mqtt_cfg = {
+    s_mqtt_cfg = (esp_mqtt_client_config_t) {
         .broker.address.uri = CONFIG_MQTT_BROKER_URL,
+#if CONFIG_MQTT_TLS_CERT_BUNDLE
+        // Only consulted for mqtts:// and wss:// brokers
+        .broker.verification.crt_bundle_attach = esp_crt_bundle_attach,
+#endif
         .credentials = {
             .client_id = CONFIG_MQTT_CLIENT_ID,
         },
+        // Reconnects are driven by s_mqtt_reconnect so they back off with jitter
+        .network.disable_auto_reconnect = true,
+        // Persistent session: session_present tells us whether the broker kept our state
+        .session.disable_clean_session = true,
+#if CONFIG_MQTT_OUTBOX_LIMIT_KB > 0
+        .outbox.limit = CONFIG_MQTT_OUTBOX_LIMIT_KB * 1024,
+#endif
+        // Lets Home Assistant mark the entities unavailable when the device drops off
+        .session.last_will = {
+            .topic = AVAILABILITY_TOPIC,
+            .msg = AVAILABILITY_OFFLINE,
+            .qos = 1,
+            .retain = true,
+        },
+#if CONFIG_MQTT5_ENABLE
+        .session.protocol_ver = MQTT_PROTOCOL_V_5,
+#else
+        .session.protocol_ver = MQTT_PROTOCOL_V_3_1_1,
+#endif
     };
 
     // Only set username/password if they are not empty
     if (strlen(CONFIG_MQTT_USERNAME) > 0) {
-        mqtt_cfg.credentials.username = CONFIG_MQTT_USERNAME;
+        s_mqtt_cfg.credentials.username = CONFIG_MQTT_USERNAME;
     } else {
         ESP_LOGW(TAG, "No MQTT username configured");
     }
 
     if (strlen(CONFIG_MQTT_PASSWORD) > 0) {
-        mqtt_cfg.credentials.authentication.password = CONFIG_MQTT_PASSWORD;
+        s_mqtt_cfg.credentials.authentication.password = CONFIG_MQTT_PASSWORD;
     } else {
         ESP_LOGW(TAG, "No MQTT password configured");
     }
 
-    mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+    ESP_ERROR_CHECK(reconnect_init(&s_mqtt_reconnect, "mqtt", mqtt_connect));
+
+    mqtt_client = esp_mqtt_client_init(&s_mqtt_cfg);
+    publisher_init(mqtt_client);
     esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     esp_mqtt_client_start(mqtt_client);
 
     ESP_LOGI(TAG, "MQTT client started");
 }
 
-/* Publish Home Assistant MQTT Discovery configuration */
-static void publish_ha_discovery(void)
+/* One retained discovery message, with its payload in rodata */
+typedef struct {
+    pub_topic_t topic;
+    const char *payload;
+    size_t payload_len;
+} discovery_msg_t;
+
+#define DISCOVERY_MSG(topic, payload) { topic, payload, sizeof(payload) - 1 }
+
+static const discovery_msg_t s_discovery_msgs[] = {
+    DISCOVERY_MSG(PUB_TOPIC_DISTANCE_CONFIG, DISTANCE_DISCOVERY_PAYLOAD),
+    DISCOVERY_MSG(PUB_TOPIC_PERCENTAGE_CONFIG, PERCENTAGE_DISCOVERY_PAYLOAD),
+};
+
+#define DISCOVERY_MSG_COUNT (sizeof(s_discovery_msgs) / sizeof(s_discovery_msgs[0]))
+
+/* 32-bit FNV-1a, used to detect changes to the discovery configuration */
+static uint32_t fnv1a(uint32_t hash, const char *str)
+{
+    while (*str) {
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* The discovery configuration is constant, so its hash only needs computing once */
+static uint32_t discovery_hash(void)
+{
+    static uint32_t hash = 0;
+
+    if (hash == 0) {
+        hash = 2166136261u;
+        for (size_t i = 0; i < DISCOVERY_MSG_COUNT; i++) {
+            hash = fnv1a(fnv1a(hash, publisher_topic_name(s_discovery_msgs[i].topic)),
+                         s_discovery_msgs[i].payload);
+        }
+    }
+    return hash;
+}
+
+static uint32_t load_discovery_hash(void)
+{
+    nvs_handle_t nvs;
+    uint32_t hash = 0;
+
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, NVS_KEY_DISCOVERY_HASH, &hash);
+        nvs_close(nvs);
+    }
+    return hash;
+}
+
+static void store_discovery_hash(uint32_t hash)
+{
+    nvs_handle_t nvs;
+
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        if (nvs_set_u32(nvs, NVS_KEY_DISCOVERY_HASH, hash) == ESP_OK) {
+            nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+}
+
+/* Discovery messages still waiting for their PUBACK, and the hash to store once
+ * the broker has acknowledged all of them. Only used from the MQTT event handler. */
+static int s_discovery_msg_ids[DISCOVERY_MSG_COUNT];
+static size_t s_discovery_pending = 0;
+static uint32_t s_discovery_pending_hash = 0;
+
+/* Call on MQTT_EVENT_PUBLISHED. The hash is stored only once the broker holds every
+ * discovery message, so a connection lost before then leads to a republish rather
+ * than a skipped discovery the broker never stored. */
+static void discovery_message_acked(int msg_id)
 {
-    if (!mqtt_connected) {
+    for (size_t i = 0; i < s_discovery_pending; i++) {
+        if (s_discovery_msg_ids[i] == msg_id) {
+            s_discovery_msg_ids[i] = s_discovery_msg_ids[--s_discovery_pending];
+            if (s_discovery_pending == 0) {
+                store_discovery_hash(s_discovery_pending_hash);
+            }
+            return;
+        }
+    }
+}
+
+/* Publish Home Assistant MQTT Discovery configuration.
+ *
+ * The messages are retained, so the broker already holds them as long as it kept
+ * our session. Unless forced (Home Assistant announced itself), publishing is
+ * skipped when the broker resumed the session and the configuration hash matches
+ * the one last published. */
+static void publish_ha_discovery(bool force)
+{
+#if CONFIG_DEVICE_ROLE_ESPNOW_GATEWAY && !CONFIG_ESPNOW_GATEWAY_LOCAL_SENSOR
+    // No sensor of its own, so no distance or percentage to announce; the nodes'
+    // entities are announced by espnow_gateway.c
+    (void)force;
+    return;
+#endif
+
+    if (!mqtt_is_connected()) {
         ESP_LOGW(TAG, "MQTT not connected, skipping discovery");
         return;
     }
 
-    char config_topic[128];
-    char config_payload[512];
+    uint32_t hash = discovery_hash();
+
+    if (!force && s_session_present && hash == load_discovery_hash()) {
+        ESP_LOGI(TAG, "Discovery unchanged and session resumed, not republishing");
+        return;
+    }
+
+    s_discovery_pending = 0;
+    for (size_t i = 0; i < DISCOVERY_MSG_COUNT; i++) {
+        const discovery_msg_t *msg = &s_discovery_msgs[i];
+        int msg_id = publisher_publish(msg->topic, msg->payload, msg->payload_len);
+        if (msg_id < 0) {
+            ESP_LOGW(TAG, "Failed to publish discovery to %s", publisher_topic_name(msg->topic));
+            s_discovery_pending = 0;
+            return;
+        }
+        // QoS 0 has no PUBACK to wait for
+        if (msg_id > 0) {
+            s_discovery_msg_ids[s_discovery_pending++] = msg_id;
+        }
+    }
+    ESP_LOGI(TAG, "Published Home Assistant discovery (hash %08" PRIx32 ")", hash);
 
-    // Discovery topic for distance sensor
-    snprintf(config_topic, sizeof(config_topic),
-             "homeassistant/sensor/%s/distance/config", CONFIG_MQTT_CLIENT_ID);
+    if (s_discovery_pending == 0) {
+        store_discovery_hash(hash);
+    } else {
+        s_discovery_pending_hash = hash;
+    }
+}
 
-    snprintf(config_payload, sizeof(config_payload),
-             "{\"name\":\"Salt Level Distance\","
-             "\"state_topic\":\"homeassistant/sensor/%s/state\","
-             "\"unit_of_measurement\":\"cm\","
-             "\"value_template\":\"{{ value_json.distance }}\","
-             "\"unique_id\":\"%s_distance\","
-             "\"device\":{\"identifiers\":[\"%s\"],"
-             "\"name\":\"Water Softener Salt Level\","
-             "\"model\":\"ESP32 HC-SR04\","
-             "\"manufacturer\":\"DIY\"}}",
-             CONFIG_MQTT_CLIENT_ID, CONFIG_MQTT_CLIENT_ID, CONFIG_MQTT_CLIENT_ID);
+static int format_reconnect_stats(char *buf, size_t len, const reconnect_stats_t *stats)
+{
+    return snprintf(buf, len,
+                    "{\"connected\":%s,\"reconnects\":%" PRIu32 ",\"current_outage_ms\":%" PRId64 ","
+                    "\"last_outage_ms\":%" PRId64 ",\"longest_outage_ms\":%" PRId64 ","
+                    "\"total_outage_ms\":%" PRId64 "}",
+                    stats->connected ? "true" : "false", stats->reconnects, stats->current_outage_ms,
+                    stats->last_outage_ms, stats->longest_outage_ms, stats->total_outage_ms);
+}
 
-    esp_mqtt_client_publish(mqtt_client, config_topic, config_payload, 0, 1, true);
-    ESP_LOGI(TAG, "Published distance sensor discovery");
+static void format_outbox_stats(json_writer_t *w)
+{
+    publisher_stats_t stats;
 
-    // Discovery topic for percentage sensor
-    snprintf(config_topic, sizeof(config_topic),
-             "homeassistant/sensor/%s/percentage/config", CONFIG_MQTT_CLIENT_ID);
+    publisher_get_stats(&stats);
+    json_write_literal(w, "{\"bytes\":");
+    json_write_int(w, stats.outbox_bytes);
+    json_write_literal(w, ",\"limit\":");
+    json_write_int(w, CONFIG_MQTT_OUTBOX_LIMIT_KB * 1024);
+    json_write_literal(w, ",\"depth\":");
+    json_write_int(w, stats.outbox_depth);
+    json_write_literal(w, ",\"refused\":{");
+    for (int i = 0; i < PUB_CLASS_COUNT; i++) {
+        if (i > 0) {
+            json_write_literal(w, ",");
+        }
+        json_write_string(w, publisher_class_name(i));
+        json_write_literal(w, ":");
+        json_write_int(w, stats.refused[i]);
+    }
+    json_write_literal(w, "}}");
+}
 
-    snprintf(config_payload, sizeof(config_payload),
-             "{\"name\":\"Salt Level Percentage\","
-             "\"state_topic\":\"homeassistant/sensor/%s/state\","
-             "\"unit_of_measurement\":\"%%\","
-             "\"value_template\":\"{{ value_json.percentage }}\","
-             "\"unique_id\":\"%s_percentage\","
-             "\"device\":{\"identifiers\":[\"%s\"]}}",
-             CONFIG_MQTT_CLIENT_ID, CONFIG_MQTT_CLIENT_ID, CONFIG_MQTT_CLIENT_ID);
+static void format_time_stats(json_writer_t *w)
+{
+    time_sync_stats_t stats;
 
-    esp_mqtt_client_publish(mqtt_client, config_topic, config_payload, 0, 1, true);
-    ESP_LOGI(TAG, "Published percentage sensor discovery");
+    time_sync_get_stats(&stats);
+    json_write_literal(w, "{\"valid\":");
+    if (stats.valid) {
+        json_write_literal(w, "true");
+    } else {
+        json_write_literal(w, "false");
+    }
+    json_write_literal(w, ",\"syncs\":");
+    json_write_int(w, stats.syncs);
+    if (stats.syncs > 0) {
+        json_write_literal(w, ",\"last_sync\":");
+        json_write_int(w, stats.last_sync_us / 1000000);
+        json_write_literal(w, ",\"offset_us\":");
+        json_write_int(w, stats.offset_us);
+    }
+    if (stats.have_drift) {
+        json_write_literal(w, ",\"drift_ppm\":");
+        json_write_float1(w, stats.drift_ppm);
+    }
+    json_write_literal(w, "}");
 }
 
-/* HC-SR04 Ultrasonic Sensor Reading */
-static float read_distance_cm(void)
+/* Publish reconnect counts, outage durations, MQTT connect timing, outbox usage
+ * and clock synchronization (retained) */
+static void publish_connectivity(void)
 {
-    // Configure GPIO pins
-    gpio_set_direction(CONFIG_SENSOR_TRIG_GPIO, GPIO_MODE_OUTPUT);
-    gpio_set_direction(CONFIG_SENSOR_ECHO_GPIO, GPIO_MODE_INPUT);
+    char wifi_json[192];
+    char mqtt_json[192];
+    char outbox_json[160];
+    char time_json[112];
+    char payload[832];
+    reconnect_stats_t stats;
+    json_writer_t w;
 
-    // Send 10us trigger pulse
-    gpio_set_level(CONFIG_SENSOR_TRIG_GPIO, 0);
-    esp_rom_delay_us(2);
-    gpio_set_level(CONFIG_SENSOR_TRIG_GPIO, 1);
-    esp_rom_delay_us(10);
-    gpio_set_level(CONFIG_SENSOR_TRIG_GPIO, 0);
+    reconnect_get_stats(&s_wifi_reconnect, &stats);
+    format_reconnect_stats(wifi_json, sizeof(wifi_json), &stats);
+    reconnect_get_stats(&s_mqtt_reconnect, &stats);
+    format_reconnect_stats(mqtt_json, sizeof(mqtt_json), &stats);
+    json_writer_init(&w, outbox_json, sizeof(outbox_json));
+    format_outbox_stats(&w);
+    json_writer_finish(&w);
+    json_writer_init(&w, time_json, sizeof(time_json));
+    format_time_stats(&w);
+    json_writer_finish(&w);
 
-    // Wait for echo pin to go high (with timeout)
-    int timeout = 0;
-    while (gpio_get_level(CONFIG_SENSOR_ECHO_GPIO) == 0 && timeout < 10000) {
-        esp_rom_delay_us(1);
-        timeout++;
-    }
+    snprintf(payload, sizeof(payload),
+             "{\"wifi\":%s,\"mqtt\":%s,\"mqtt_connect_ms\":{\"last\":%" PRId64 ",\"max\":%" PRId64 "},"
+             "\"outbox\":%s,\"time\":%s}",
+             wifi_json, mqtt_json, s_connect_last_ms, s_connect_max_ms, outbox_json, time_json);
+
+    publisher_publish(PUB_TOPIC_CONNECTIVITY, payload, 0);
+}
 
-    if (timeout >= 10000) {
-        ESP_LOGW(TAG, "HC-SR04 timeout waiting for echo start");
-        return -1.0f;
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+/* Wait until the broker acknowledges msg_id. Other QoS 1 publishes (e.g. discovery)
+ * also wake us, so keep waiting until our own id shows up, nothing arrives in time,
+ * or the connection drops. */
+static bool wait_for_ack(int msg_id)
+{
+    while (s_last_acked_msg_id != msg_id) {
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(REPLAY_ACK_TIMEOUT_MS)) == 0 ||
+            !mqtt_is_connected()) {
+            return false;
+        }
     }
+    return true;
+}
+
+/* Replay readings queued while offline onto the history topic, oldest first.
+ * Each one is published at QoS 1 and only removed from flash once acknowledged. */
+static void replay_task(void *pvParameters)
+{
+    static char payload[96];
+    reading_t reading;
+
+    while (1) {
+        xEventGroupWaitBits(s_conn_event_group, MQTT_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+
+        // Readings are only queued while offline, so an empty queue stays empty
+        // until the next reconnect notifies us
+        if (offline_queue_peek(&reading) != ESP_OK) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        json_writer_t w;
+        json_writer_init(&w, payload, sizeof(payload));
+        json_write_literal(&w, "{");
+        // The stored timestamp tells whether the clock was set when the reading
+        // was taken, which survives a reboot; before that it was time since boot
+        if (time_sync_timestamp_valid(reading.timestamp_us)) {
+            json_write_literal(&w, "\"timestamp\":");
+            json_write_int(&w, reading.timestamp_us / 1000000);
+            json_write_literal(&w, ",");
+        }
+        json_write_literal(&w, "\"distance\":");
+        json_write_float1(&w, reading.distance_cm);
+        json_write_literal(&w, ",\"percentage\":");
+        json_write_float1(&w, reading.percentage);
+        json_write_literal(&w, "}");
+        json_writer_finish(&w);
 
-    // Measure pulse width
-    int64_t start_time = esp_timer_get_time();
-    timeout = 0;
+        // Drop any stale acknowledgement before publishing
+        ulTaskNotifyTake(pdTRUE, 0);
+        int msg_id = publisher_publish(PUB_TOPIC_HISTORY, payload, w.len);
 
-    while (gpio_get_level(CONFIG_SENSOR_ECHO_GPIO) == 1 && timeout < 30000) {
-        esp_rom_delay_us(1);
-        timeout++;
+        if (msg_id >= 0 && wait_for_ack(msg_id)) {
+            offline_queue_pop();
+            if (offline_queue_count() == 0) {
+                ESP_LOGI(TAG, "Offline backlog replayed");
+            }
+        } else {
+            ESP_LOGW(TAG, "Replayed reading not acknowledged, will retry");
+        }
+
+        // Rate-limit the replay so a long backlog doesn't flood the broker
+        vTaskDelay(pdMS_TO_TICKS(1000 / CONFIG_OFFLINE_QUEUE_REPLAY_RATE));
     }
+}
+#endif
+
+/* Publish one reading on the state topic(s). Only called from the publish task. */
+static void publish_state(const reading_t *reading)
+{
+#if CONFIG_STATE_PUBLISH_JSON
+    static char payload[JSON_STATE_MAX_LEN];
+
+    uint32_t t = bench_now();
+    size_t len = json_state_encode(payload, sizeof(payload), reading);
+    t = bench_record(BENCH_SERIALIZE, t);
+    int msg_id = publisher_publish(PUB_TOPIC_STATE, payload, len);
+    bench_record(BENCH_ENQUEUE, t);
+    ESP_LOGI(TAG, "Published to MQTT, msg_id=%d", msg_id);
+#endif
+#if CONFIG_STATE_PUBLISH_CBOR
+    static uint8_t cbor_payload[CBOR_STATE_MAX_LEN];
 
-    if (timeout >= 30000) {
-        ESP_LOGW(TAG, "HC-SR04 timeout waiting for echo end");
-        return -1.0f;
+    uint32_t cbor_t = bench_now();
+    int64_t timestamp_ms = time_sync_timestamp_valid(reading->timestamp_us) ?
+                           reading->timestamp_us / 1000 : 0;
+    size_t cbor_len = cbor_state_encode(cbor_payload, sizeof(cbor_payload),
+                                        reading->distance_cm, reading->percentage, timestamp_ms);
+    cbor_t = bench_record(BENCH_SERIALIZE, cbor_t);
+    int cbor_msg_id = publisher_publish(PUB_TOPIC_STATE_CBOR, (const char *)cbor_payload, cbor_len);
+    bench_record(BENCH_ENQUEUE, cbor_t);
+    ESP_LOGI(TAG, "Published %zu-byte CBOR state, msg_id=%d", cbor_len, cbor_msg_id);
+#endif
+}
+
+#if CONFIG_BATCH_ENABLE
+/* Publish the collected readings as one message, then refresh the state topic
+ * with the newest one since that is what the Home Assistant entities read */
+static void publish_batch(void)
+{
+    size_t count = batch_count();
+
+    if (count == 0) {
+        return;
     }
 
-    int64_t end_time = esp_timer_get_time();
-    int64_t pulse_duration = end_time - start_time;
+#if CONFIG_STATE_PUBLISH_JSON
+    static char payload[BATCH_JSON_MAX_LEN];
+
+    uint32_t t = bench_now();
+    size_t len = batch_encode_json(payload, sizeof(payload));
+    t = bench_record(BENCH_BATCH_SERIALIZE, t);
+    int msg_id = publisher_publish(PUB_TOPIC_BATCH, payload, len);
+    bench_record(BENCH_BATCH_ENQUEUE, t);
+    ESP_LOGI(TAG, "Published batch of %zu readings (%zu bytes), msg_id=%d", count, len, msg_id);
+#endif
+#if CONFIG_STATE_PUBLISH_CBOR
+    static uint8_t cbor_payload[CBOR_BATCH_MAX_LEN(CONFIG_BATCH_MAX_READINGS)];
 
-    // Calculate distance: speed of sound is 343 m/s or 0.0343 cm/us
-    // Distance = (pulse_duration * 0.0343) / 2
-    float distance = (pulse_duration * 0.0343f) / 2.0f;
+    uint32_t cbor_t = bench_now();
+    size_t cbor_len = cbor_batch_encode(cbor_payload, sizeof(cbor_payload), batch_readings(), count);
+    cbor_t = bench_record(BENCH_BATCH_SERIALIZE, cbor_t);
+    int cbor_msg_id = publisher_publish(PUB_TOPIC_BATCH_CBOR, (const char *)cbor_payload, cbor_len);
+    bench_record(BENCH_BATCH_ENQUEUE, cbor_t);
+    ESP_LOGI(TAG, "Published %zu-byte CBOR batch, msg_id=%d", cbor_len, cbor_msg_id);
+#endif
 
-    ESP_LOGI(TAG, "HC-SR04 reading: %.1f cm (pulse: %lld us)", distance, pulse_duration);
+    publish_state(&batch_readings()[count - 1]);
+    batch_clear();
+}
+#endif
 
-    // Sanity check: HC-SR04 range is 2cm to 400cm
-    if (distance < 2.0f || distance > 400.0f) {
-        ESP_LOGW(TAG, "Distance out of range: %.1f cm", distance);
-        return -1.0f;
+/* Keep a reading that could not be published */
+static void store_offline(const reading_t *reading)
+{
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+    if (reading->distance_cm >= 0 && offline_queue_push(reading) == ESP_OK) {
+        ESP_LOGW(TAG, "MQTT not connected, queued reading (%" PRIu32 " pending)", offline_queue_count());
+        return;
     }
+#endif
+    ESP_LOGW(TAG, "MQTT not connected, skipping publish");
+}
 
-    return distance;
+/* esp_timer time of the first sampling deadline after timer_us. Once the clock is
+ * set, deadlines fall on whole multiples of the interval in wall-clock time, so
+ * devices with the same interval sample at the same instants. */
+static int64_t next_deadline_us(int64_t timer_us, int64_t interval_us)
+{
+    if (!time_sync_valid()) {
+        return timer_us + interval_us;
+    }
+
+    int64_t next_us = timer_us + interval_us - time_sync_from_timer_us(timer_us) % interval_us;
+    // A clock stepped back by SNTP could put the next multiple just ahead
+    if (next_us - timer_us < interval_us / 2) {
+        next_us += interval_us;
+    }
+    return next_us;
 }
 
-/* Calculate salt level percentage from distance */
-static float calculate_percentage(float distance_cm)
+/* Turn an echo into a reading and hand it to the publish task through the sample
+ * ring. latency_us is how long ranging took. */
+static void submit_reading(int64_t echo_us, int64_t edge_us, int64_t latency_us,
+                           const settings_t *settings)
 {
-    float tank_height = (float)CONFIG_TANK_HEIGHT_CM;
+    uint32_t t = bench_now();
 
-    // Distance is measured from top, so we need to invert it
-    // If distance is small (near top), tank is nearly full
-    // If distance is large (near bottom), tank is nearly empty
-    float salt_height = tank_height - distance_cm;
-    float percentage = (salt_height / tank_height) * 100.0f;
+    // Stamped with the time the echo arrived rather than when the reading is
+    // built or published
+    reading_t reading;
+    bool valid = ranging_make_reading(echo_us, time_sync_from_timer_us(edge_us), settings,
+                                      true, &reading);
+    t = bench_record(BENCH_CONVERT, t);
+    metrics_record_reading(&reading, latency_us);
 
-    // Clamp between 0 and 100
-    if (percentage < 0) percentage = 0;
-    if (percentage > 100) percentage = 100;
+    // A failed ping is counted as a read error and Home Assistant keeps the last
+    // good reading
+    if (!valid) {
+        return;
+    }
 
-    return percentage;
+    t = bench_now();
+    if (sample_ring_push(&reading)) {
+        xTaskNotifyGive(s_publish_task);
+        bench_record(BENCH_HANDOFF, t);
+    } else {
+        ESP_LOGW(TAG, "Publish task is behind, dropped reading");
+    }
 }
 
-/* Main sensor reading and publishing task */
+#if CONFIG_BENCHMARK_ENABLE
+/* Take CONFIG_BENCHMARK_ITERATIONS readings back to back through the normal path,
+ * timing every stage (see bench.h); the publish task reports once they are through */
+static void run_benchmark(void)
+{
+    // Wait for MQTT so the serialization and enqueue stages are measured as well
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    ESP_LOGI(TAG, "Benchmark: %d readings, %d ms apart",
+             CONFIG_BENCHMARK_ITERATIONS, CONFIG_BENCHMARK_PERIOD_MS);
+
+    bench_start();
+    for (int i = 0; i < CONFIG_BENCHMARK_ITERATIONS; i++) {
+        int64_t edge_us;
+        int64_t read_start_us = esp_timer_get_time();
+        int64_t echo_us = hal_ranging_echo_us(&edge_us);
+        submit_reading(echo_us, edge_us, esp_timer_get_time() - read_start_us,
+                       settings_current());
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_BENCHMARK_PERIOD_MS));
+    }
+    bench_finish();
+    xTaskNotifyGive(s_publish_task);
+}
+#endif
+
+/* Acquisition task: waits for the next reading, ranges and hands the reading to the
+ * publish task through the sample ring. It never touches the network, so a slow
+ * publish cannot delay a reading.
+ *
+ * Readings are due at absolute deadlines, each one interval after the previous
+ * deadline rather than after the previous reading, so ranging time and wake-up
+ * latency never accumulate into drift. */
 static void sensor_task(void *pvParameters)
 {
-    // Wait for MQTT to connect
-    ESP_LOGI(TAG, "Waiting for MQTT connection...");
-    while (!mqtt_connected) {
-        vTaskDelay(pdMS_TO_TICKS(1000));
+#if CONFIG_BENCHMARK_ENABLE
+    run_benchmark();
+#endif
+
+    int64_t interval_us = settings_current()->reading_interval_sec * 1000000LL;
+    int64_t deadline_us = next_deadline_us(esp_timer_get_time(), interval_us);
+
+    while (1) {
+        // Sleep until the next deadline. MQTT_EVENT_CONNECTED wakes us early, so the
+        // first reading after boot or a reconnect is published straight away; so does
+        // a settings change. Neither moves the deadlines.
+        int64_t wait_us = deadline_us - esp_timer_get_time();
+#if CONFIG_SENSOR_STREAM_ENABLE
+        // While a stream client watches, wake at the stream rate in between readings
+        if (stream_active() && wait_us > STREAM_PERIOD_US) {
+            wait_us = STREAM_PERIOD_US;
+        }
+#endif
+        // Round up so a timeout never lands just short of the deadline
+        TickType_t wait_ticks = wait_us > 0 ? (wait_us + portTICK_PERIOD_MS * 1000 - 1) /
+                                              (portTICK_PERIOD_MS * 1000) : 0;
+        bool woken = ulTaskNotifyTake(pdTRUE, wait_ticks) > 0;
+
+        int64_t read_start_us = esp_timer_get_time();
+        bool scheduled = read_start_us >= deadline_us;
+        int64_t edge_us;
+        int64_t echo_us = hal_ranging_echo_us(&edge_us);
+        int64_t read_end_us = esp_timer_get_time();
+
+#if CONFIG_SENSOR_STREAM_ENABLE
+        if (stream_active()) {
+            stream_push(echo_us, ranging_distance_cm(echo_us, false));
+        }
+#endif
+        if (!woken && !scheduled) {
+            continue;
+        }
+
+        if (scheduled) {
+            // Deadlines that passed entirely while we were late are skipped, not made up
+            int64_t late_us = read_start_us - deadline_us;
+            uint32_t missed = late_us / interval_us;
+            metrics_record_deadline(late_us, missed);
+            deadline_us = next_deadline_us(deadline_us + missed * interval_us, interval_us);
+        }
+
+        // One snapshot per reading, so interval and tank height always match
+        const settings_t *settings = settings_current();
+        if (settings->reading_interval_sec * 1000000LL != interval_us) {
+            interval_us = settings->reading_interval_sec * 1000000LL;
+            deadline_us = next_deadline_us(read_start_us, interval_us);
+        }
+
+        submit_reading(echo_us, edge_us, read_end_us - read_start_us, settings);
     }
+}
 
-    // Wait a bit more to ensure connection is stable
-    vTaskDelay(pdMS_TO_TICKS(2000));
+/* Send one reading on its way: to the gateway on an ESP-NOW node, otherwise to MQTT
+ * or, while disconnected, to the offline queue */
+static void handle_reading(const reading_t *reading)
+{
+    static uint32_t published_reconnects = UINT32_MAX;
+    static uint32_t published_syncs = UINT32_MAX;
 
-    // Publish discovery messages
-    ESP_LOGI(TAG, "Publishing Home Assistant discovery messages...");
-    publish_ha_discovery();
-    ESP_LOGI(TAG, "Discovery messages sent!");
+    ESP_LOGI(TAG, "Distance: %.1f cm, Salt level: %.1f%%", reading->distance_cm, reading->percentage);
 
-    char state_topic[128];
-    char payload[256];
+#if CONFIG_DEVICE_ROLE_ESPNOW_NODE
+    espnow_node_send(reading);
+    return;
+#endif
 
-    snprintf(state_topic, sizeof(state_topic),
-             "homeassistant/sensor/%s/state", CONFIG_MQTT_CLIENT_ID);
+    if (mqtt_is_connected()) {
+#if CONFIG_BATCH_ENABLE
+        if (batch_add(reading)) {
+            publish_batch();
+        }
+#else
+        publish_state(reading);
+#endif
 
-    while (1) {
-        // Read sensor
-        float distance = read_distance_cm();
-        float percentage = calculate_percentage(distance);
+        // Refresh the connectivity statistics whenever a link has recovered or the
+        // clock was synchronized since last time
+        reconnect_stats_t wifi_stats, mqtt_stats;
+        time_sync_stats_t time_stats;
+        reconnect_get_stats(&s_wifi_reconnect, &wifi_stats);
+        reconnect_get_stats(&s_mqtt_reconnect, &mqtt_stats);
+        time_sync_get_stats(&time_stats);
+        uint32_t reconnects = wifi_stats.reconnects + mqtt_stats.reconnects;
+        if (reconnects != published_reconnects || time_stats.syncs != published_syncs) {
+            publish_connectivity();
+            published_reconnects = reconnects;
+            published_syncs = time_stats.syncs;
+        }
+    } else {
+#if CONFIG_BATCH_ENABLE
+        // The connection dropped with a partial batch; keep it along with this reading
+        for (size_t i = 0; i < batch_count(); i++) {
+            store_offline(&batch_readings()[i]);
+        }
+        batch_clear();
+#endif
+        store_offline(reading);
+    }
+}
+
+#if CONFIG_DIAGNOSTICS_ENABLE
+static void publish_diagnostics(void)
+{
+    static char payload[DIAGNOSTICS_JSON_MAX_LEN];
+    json_writer_t w;
 
-        ESP_LOGI(TAG, "Distance: %.1f cm, Salt level: %.1f%%", distance, percentage);
+    json_writer_init(&w, payload, sizeof(payload));
+    diagnostics_write_json(&w);
+    if (json_writer_finish(&w) == NULL) {
+        ESP_LOGW(TAG, "Diagnostics snapshot too large");
+        return;
+    }
+    publisher_publish(PUB_TOPIC_DIAGNOSTICS, payload, w.len);
+}
+#endif
 
-        // Publish to MQTT
-        if (mqtt_connected) {
-            snprintf(payload, sizeof(payload),
-                     "{\"distance\":%.1f,\"percentage\":%.1f}",
-                     distance, percentage);
+#if CONFIG_BENCHMARK_ENABLE
+static void publish_benchmark(void)
+{
+    static char payload[BENCH_JSON_MAX_LEN];
+    json_writer_t w;
 
-            int msg_id = esp_mqtt_client_publish(mqtt_client, state_topic, payload, 0, 0, false);
-            ESP_LOGI(TAG, "Published to MQTT, msg_id=%d", msg_id);
-        } else {
-            ESP_LOGW(TAG, "MQTT not connected, skipping publish");
+    bench_log();
+    json_writer_init(&w, payload, sizeof(payload));
+    bench_write_json(&w);
+    if (json_writer_finish(&w) == NULL) {
+        ESP_LOGW(TAG, "Benchmark report too large");
+        return;
+    }
+    publisher_publish(PUB_TOPIC_BENCHMARK, payload, w.len);
+}
+#endif
+
+/* Publish task: drains the sample ring whenever the sensor task adds to it, sends
+ * queued stream samples, and publishes the diagnostics snapshot at its slow cadence */
+static void publish_task(void *pvParameters)
+{
+    reading_t reading;
+    TickType_t wait_ticks = portMAX_DELAY;
+#if CONFIG_DIAGNOSTICS_ENABLE
+    int64_t next_diagnostics_us = esp_timer_get_time() + CONFIG_DIAGNOSTICS_INTERVAL_SEC * 1000000LL;
+#endif
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, wait_ticks);
+#if CONFIG_BENCHMARK_ENABLE
+        // Checked before draining, so the report includes every reading of the burst
+        bool bench_done = bench_report_due();
+#endif
+        while (sample_ring_pop(&reading)) {
+            handle_reading(&reading);
+        }
+#if CONFIG_SENSOR_STREAM_ENABLE
+        stream_flush();
+#endif
+#if CONFIG_BENCHMARK_ENABLE
+        if (bench_done) {
+            publish_benchmark();
         }
+#endif
 
-        // Wait for next reading
-        vTaskDelay(pdMS_TO_TICKS(CONFIG_READING_INTERVAL_SEC * 1000));
+#if CONFIG_DIAGNOSTICS_ENABLE
+        int64_t now_us = esp_timer_get_time();
+        if (now_us >= next_diagnostics_us) {
+            // Skipped while offline: the snapshot is only interesting when fresh
+            if (mqtt_is_connected()) {
+                publish_diagnostics();
+            }
+            next_diagnostics_us = now_us + CONFIG_DIAGNOSTICS_INTERVAL_SEC * 1000000LL;
+        }
+        wait_ticks = pdMS_TO_TICKS((next_diagnostics_us - now_us) / 1000) + 1;
+#endif
     }
 }
 
+/* Create the acquisition and publish tasks. The publish task comes first so it is
+ * ready for the first reading. */
+static void start_reading_tasks(void)
+{
+    s_publish_task = xTaskCreateStaticPinnedToCore(publish_task, "publish_task",
+                                                   CONFIG_PUBLISH_TASK_STACK_SIZE, NULL,
+                                                   PUBLISH_TASK_PRIORITY, s_publish_stack,
+                                                   &s_publish_tcb, PUBLISH_TASK_CORE);
+    metrics_register_task(s_publish_task, "publish");
+    s_sensor_task = xTaskCreateStaticPinnedToCore(sensor_task, "sensor_task",
+                                                  CONFIG_SENSOR_TASK_STACK_SIZE, NULL,
+                                                  SENSOR_TASK_PRIORITY, s_sensor_stack,
+                                                  &s_sensor_tcb, SENSOR_TASK_CORE);
+    metrics_register_task(s_sensor_task, "sensor");
+    // Acquisition never allocates; publishing does, inside esp-mqtt
+    heap_guard_watch_task(s_sensor_task);
+}
+
 void app_main(void)
 {
+    heap_guard_boot_start();
     ESP_LOGI(TAG, "Water Softener Salt Level Monitor starting...");
 
     // Initialize NVS
@@ -364,16 +1118,68 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+    settings_init();
+
+#if CONFIG_FLEET_SIM_ENABLE
+    // The linux build stands in for a whole fleet rather than this one device
+    fleet_sim_start();
+    return;
+#endif
+
+#if CONFIG_DEVICE_ROLE_ESPNOW_NODE
+    // A node only needs the radio: readings go straight to the gateway over ESP-NOW
+    ESP_ERROR_CHECK(espnow_node_init());
+    start_reading_tasks();
+    // There is no connect event to trigger the first reading
+    xTaskNotifyGive(s_sensor_task);
+    heap_guard_init_done();
+    ESP_LOGI(TAG, "Initialization complete (ESP-NOW node)");
+    return;
+#endif
+
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+    // Recover readings left over from a previous outage before going online
+    bool offline_queue_ready = (offline_queue_init() == ESP_OK);
+#endif
+
     // Initialize Wi-Fi
     ESP_LOGI(TAG, "Connecting to Wi-Fi...");
     wifi_init_sta();
 
+#if CONFIG_DEVICE_ROLE_ESPNOW_GATEWAY
+    ESP_ERROR_CHECK(espnow_gateway_start());
+#endif
+
+    // Create the tasks before MQTT starts so they see the first MQTT_EVENT_CONNECTED
+#if !CONFIG_DEVICE_ROLE_ESPNOW_GATEWAY || CONFIG_ESPNOW_GATEWAY_LOCAL_SENSOR
+    start_reading_tasks();
+#if CONFIG_SENSOR_STREAM_ENABLE
+    stream_init(s_sensor_task, s_publish_task);
+#endif
+#endif
+
+#if CONFIG_OFFLINE_QUEUE_ENABLE
+    // Lower priority than the publish task so live readings go out first
+    if (offline_queue_ready) {
+        s_replay_task = xTaskCreateStatic(replay_task, "replay_task", CONFIG_REPLAY_TASK_STACK_SIZE,
+                                          NULL, 4, s_replay_stack, &s_replay_tcb);
+        metrics_register_task(s_replay_task, "replay");
+    }
+#endif
+
+    // SNTP runs in the background while MQTT connects; readings taken before the
+    // first sync carry no timestamp unless the RTC kept the time
+    time_sync_start();
+
     // Initialize MQTT
     ESP_LOGI(TAG, "Starting MQTT client...");
     mqtt_app_start();
 
-    // Create sensor reading task
-    xTaskCreate(sensor_task, "sensor_task", 4096, NULL, 5, NULL);
+#if CONFIG_HTTP_STATUS_ENABLE
+    // Not fatal: the device works without it
+    http_status_start(&s_wifi_reconnect, &s_mqtt_reconnect);
+#endif
 
+    heap_guard_init_done();
     ESP_LOGI(TAG, "Initialization complete");
 }
@@ -0,0 +1,62 @@
+/* Lock-free hand-off of readings from acquisition to publishing */
+
+#include <stdatomic.h>
+#include "sample_ring.h"
+
+_Static_assert((SAMPLE_RING_LEN & (SAMPLE_RING_LEN - 1)) == 0, "SAMPLE_RING_LEN must be a power of two");
+
+#define RING_MASK (SAMPLE_RING_LEN - 1)
+
+static reading_t s_slots[SAMPLE_RING_LEN];
+
+/* Free-running counters; head - tail is the number of readings waiting */
+static atomic_uint_fast32_t s_head;         // Written by the producer only
+static atomic_uint_fast32_t s_tail;         // Written by the consumer only
+
+static atomic_uint_fast32_t s_pushed;
+static atomic_uint_fast32_t s_overruns;
+static atomic_uint_fast32_t s_high_water;
+
+bool sample_ring_push(const reading_t *reading)
+{
+    uint32_t head = atomic_load_explicit(&s_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&s_tail, memory_order_acquire);
+    uint32_t used = head - tail;
+
+    if (used == SAMPLE_RING_LEN) {
+        atomic_fetch_add_explicit(&s_overruns, 1, memory_order_relaxed);
+        return false;
+    }
+
+    s_slots[head & RING_MASK] = *reading;
+    // Release: the slot contents become visible before the new head
+    atomic_store_explicit(&s_head, head + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&s_pushed, 1, memory_order_relaxed);
+    if (used + 1 > atomic_load_explicit(&s_high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&s_high_water, used + 1, memory_order_relaxed);
+    }
+    return true;
+}
+
+bool sample_ring_pop(reading_t *reading)
+{
+    uint32_t tail = atomic_load_explicit(&s_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&s_head, memory_order_acquire);
+
+    if (head == tail) {
+        return false;
+    }
+
+    *reading = s_slots[tail & RING_MASK];
+    // Release: the slot is only handed back to the producer once it has been read
+    atomic_store_explicit(&s_tail, tail + 1, memory_order_release);
+    return true;
+}
+
+void sample_ring_get_stats(sample_ring_stats_t *stats)
+{
+    stats->pushed = atomic_load_explicit(&s_pushed, memory_order_relaxed);
+    stats->overruns = atomic_load_explicit(&s_overruns, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&s_high_water, memory_order_relaxed);
+}
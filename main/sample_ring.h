@@ -0,0 +1,37 @@
+/* Lock-free hand-off of readings from acquisition to publishing
+ *
+ * A fixed-capacity single-producer/single-consumer ring: the acquisition task
+ * pushes, the publish task pops, and neither ever blocks or takes a lock. Each
+ * index is written by one side only and published with release/acquire ordering,
+ * so the ring is safe across cores without a critical section.
+ *
+ * When the publisher falls behind and the ring is full, the new reading is
+ * dropped and counted as an overrun; the readings already queued are older and
+ * still go out in order.
+ *
+ * Plain C11 with no ESP-IDF dependencies, so it also builds for the Linux host target.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "reading.h"
+
+/* Capacity in readings; a power of two so indices wrap with a mask */
+#define SAMPLE_RING_LEN 16
+
+typedef struct {
+    uint32_t pushed;            // Readings accepted since boot
+    uint32_t overruns;          // Readings dropped because the ring was full
+    uint32_t high_water;        // Most readings ever waiting at once
+} sample_ring_stats_t;
+
+/* Producer side. Returns false (and counts an overrun) if the ring is full. */
+bool sample_ring_push(const reading_t *reading);
+
+/* Consumer side. Returns false if the ring is empty. */
+bool sample_ring_pop(reading_t *reading);
+
+/* Safe to call from any task */
+void sample_ring_get_stats(sample_ring_stats_t *stats);
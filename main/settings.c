@@ -0,0 +1,322 @@
+/* Runtime settings */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "settings.h"
+
+static const char *TAG = "SETTINGS";
+
+#define NVS_NAMESPACE     "salt_level"
+#define NVS_KEY_SETTINGS  "settings"
+
+#define MAX_KEY_LEN 32
+
+/* What is saved in NVS; the version guards against reading an older layout */
+typedef struct {
+    uint32_t version;
+    settings_t settings;
+} stored_settings_t;
+
+/* A field that may appear in a config document, with its valid range. The ranges
+ * match the Kconfig options that provide the defaults. */
+typedef struct {
+    const char *name;
+    size_t offset;
+    uint32_t min;
+    uint32_t max;
+} field_t;
+
+static const field_t s_fields[] = {
+    { "reading_interval_sec", offsetof(settings_t, reading_interval_sec), 5, 3600 },
+    { "tank_height_cm", offsetof(settings_t, tank_height_cm), 10, 500 },
+};
+
+#define FIELD_COUNT (sizeof(s_fields) / sizeof(s_fields[0]))
+
+#define DEFAULT_SETTINGS {                                   \
+    .reading_interval_sec = CONFIG_READING_INTERVAL_SEC,    \
+    .tank_height_cm = CONFIG_TANK_HEIGHT_CM,                \
+}
+
+/* Snapshots are written only while they are not current and never modified once
+ * published. Updates take turns through the slots, so a snapshot survives
+ * SETTINGS_SNAPSHOTS - 1 further updates before its slot is reused;
+ * updates arrive at the pace of someone sending commands, readers hold a snapshot
+ * for one reading. */
+static settings_t s_snapshots[SETTINGS_SNAPSHOTS] = { [0] = DEFAULT_SETTINGS };
+static _Atomic(const settings_t *) s_current = &s_snapshots[0];
+static size_t s_next_snapshot = 1;              // Updates only, under s_lock
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t *field_ptr(settings_t *settings, const field_t *field)
+{
+    return (uint32_t *)((uint8_t *)settings + field->offset);
+}
+
+static uint32_t field_value(const settings_t *settings, const field_t *field)
+{
+    return *(const uint32_t *)((const uint8_t *)settings + field->offset);
+}
+
+static const field_t *find_field(const char *name)
+{
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        if (strcmp(s_fields[i].name, name) == 0) {
+            return &s_fields[i];
+        }
+    }
+    return NULL;
+}
+
+/* Check every field against its range; used for NVS contents as well as documents */
+static const field_t *first_invalid_field(const settings_t *settings)
+{
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        uint32_t value = field_value(settings, &s_fields[i]);
+        if (value < s_fields[i].min || value > s_fields[i].max) {
+            return &s_fields[i];
+        }
+    }
+    return NULL;
+}
+
+/* Make settings current. Copies into a snapshot slot that is not current, then
+ * publishes it with one release store, so readers never see a partial update. */
+static void publish(const settings_t *settings)
+{
+    taskENTER_CRITICAL(&s_lock);
+    settings_t *snapshot = &s_snapshots[s_next_snapshot];
+    s_next_snapshot = (s_next_snapshot + 1) % SETTINGS_SNAPSHOTS;
+    *snapshot = *settings;
+    atomic_store_explicit(&s_current, snapshot, memory_order_release);
+    taskEXIT_CRITICAL(&s_lock);
+}
+
+void settings_init(void)
+{
+    nvs_handle_t nvs;
+    stored_settings_t stored;
+    size_t len = sizeof(stored);
+
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    esp_err_t err = nvs_get_blob(nvs, NVS_KEY_SETTINGS, &stored, &len);
+    nvs_close(nvs);
+
+    if (err != ESP_OK || len != sizeof(stored) || stored.version != SETTINGS_VERSION ||
+        first_invalid_field(&stored.settings) != NULL) {
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(TAG, "Ignoring unusable saved settings, using defaults");
+        }
+        return;
+    }
+
+    publish(&stored.settings);
+    ESP_LOGI(TAG, "Loaded settings: interval %" PRIu32 " s, tank height %" PRIu32 " cm",
+             stored.settings.reading_interval_sec, stored.settings.tank_height_cm);
+}
+
+const settings_t *settings_current(void)
+{
+    // Acquire pairs with the release in publish(): the snapshot contents are visible
+    return atomic_load_explicit(&s_current, memory_order_acquire);
+}
+
+static esp_err_t save(const settings_t *settings)
+{
+    nvs_handle_t nvs;
+    stored_settings_t stored = {
+        .version = SETTINGS_VERSION,
+        .settings = *settings,
+    };
+
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = nvs_set_blob(nvs, NVS_KEY_SETTINGS, &stored, sizeof(stored));
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    return err;
+}
+
+/* Just enough of a JSON parser for a flat object of integers */
+typedef struct {
+    const char *pos;
+    const char *end;
+} parser_t;
+
+static void skip_ws(parser_t *p)
+{
+    while (p->pos < p->end &&
+           (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r')) {
+        p->pos++;
+    }
+}
+
+static bool consume(parser_t *p, char c)
+{
+    skip_ws(p);
+    if (p->pos < p->end && *p->pos == c) {
+        p->pos++;
+        return true;
+    }
+    return false;
+}
+
+/* Field names are plain ASCII, so escape sequences are not supported */
+static bool parse_key(parser_t *p, char *key, size_t size)
+{
+    size_t len = 0;
+
+    if (!consume(p, '"')) {
+        return false;
+    }
+    while (p->pos < p->end && *p->pos != '"') {
+        if (*p->pos == '\\' || len + 1 >= size) {
+            return false;
+        }
+        key[len++] = *p->pos++;
+    }
+    key[len] = '\0';
+    return consume(p, '"');
+}
+
+static bool parse_int(parser_t *p, int64_t *value)
+{
+    bool negative = false;
+    int digits = 0;
+
+    skip_ws(p);
+    if (p->pos < p->end && *p->pos == '-') {
+        negative = true;
+        p->pos++;
+    }
+    *value = 0;
+    while (p->pos < p->end && *p->pos >= '0' && *p->pos <= '9') {
+        // Anything longer is out of range for every field anyway
+        if (++digits > 10) {
+            return false;
+        }
+        *value = *value * 10 + (*p->pos++ - '0');
+    }
+    if (negative) {
+        *value = -*value;
+    }
+    // Reject fractions and exponents rather than truncating them
+    if (p->pos < p->end && (*p->pos == '.' || *p->pos == 'e' || *p->pos == 'E')) {
+        return false;
+    }
+    return digits > 0;
+}
+
+/* Parse a document on top of the current settings */
+static bool parse_document(const char *data, size_t len, settings_t *settings,
+                           char *reason, size_t reason_len)
+{
+    parser_t p = { .pos = data, .end = data + len };
+    char key[MAX_KEY_LEN];
+    int64_t value;
+    bool have_version = false;
+
+    if (!consume(&p, '{')) {
+        snprintf(reason, reason_len, "not a JSON object");
+        return false;
+    }
+    if (!consume(&p, '}')) {
+        do {
+            if (!parse_key(&p, key, sizeof(key)) || !consume(&p, ':')) {
+                snprintf(reason, reason_len, "malformed document");
+                return false;
+            }
+            if (!parse_int(&p, &value)) {
+                snprintf(reason, reason_len, "%s: expected an integer", key);
+                return false;
+            }
+
+            if (strcmp(key, "version") == 0) {
+                if (value != SETTINGS_VERSION) {
+                    snprintf(reason, reason_len, "unsupported version %" PRId64, value);
+                    return false;
+                }
+                have_version = true;
+                continue;
+            }
+
+            const field_t *field = find_field(key);
+            if (field == NULL) {
+                snprintf(reason, reason_len, "unknown field %s", key);
+                return false;
+            }
+            if (value < field->min || value > field->max) {
+                snprintf(reason, reason_len, "%s must be %" PRIu32 "-%" PRIu32, key, field->min, field->max);
+                return false;
+            }
+            *field_ptr(settings, field) = (uint32_t)value;
+        } while (consume(&p, ','));
+
+        if (!consume(&p, '}')) {
+            snprintf(reason, reason_len, "malformed document");
+            return false;
+        }
+    }
+
+    skip_ws(&p);
+    if (p.pos != p.end) {
+        snprintf(reason, reason_len, "trailing data after document");
+        return false;
+    }
+    if (!have_version) {
+        snprintf(reason, reason_len, "missing version");
+        return false;
+    }
+    return true;
+}
+
+esp_err_t settings_apply_json(const char *data, size_t len, char *reason, size_t reason_len)
+{
+    settings_t current = *settings_current();
+    settings_t settings = current;
+    if (!parse_document(data, len, &settings, reason, reason_len)) {
+        ESP_LOGW(TAG, "Rejected settings: %s", reason);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Skip the flash write when nothing changed, e.g. a retained command replayed on connect
+    if (memcmp(&settings, &current, sizeof(settings)) != 0) {
+        esp_err_t err = save(&settings);
+        if (err != ESP_OK) {
+            snprintf(reason, reason_len, "could not save settings (%s)", esp_err_to_name(err));
+            ESP_LOGE(TAG, "%s", reason);
+            return err;
+        }
+    }
+
+    publish(&settings);
+
+    ESP_LOGI(TAG, "Applied settings: interval %" PRIu32 " s, tank height %" PRIu32 " cm",
+             settings.reading_interval_sec, settings.tank_height_cm);
+    return ESP_OK;
+}
+
+void settings_write_json(json_writer_t *w, const settings_t *settings)
+{
+    json_write_literal(w, "{\"version\":");
+    json_write_int(w, SETTINGS_VERSION);
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        json_write_literal(w, ",\"");
+        json_write_raw(w, s_fields[i].name, strlen(s_fields[i].name));
+        json_write_literal(w, "\":");
+        json_write_int(w, field_value(settings, &s_fields[i]));
+    }
+    json_write_literal(w, "}");
+}
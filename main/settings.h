@@ -0,0 +1,53 @@
+/* Runtime settings
+ *
+ * Settings that can be changed without reflashing, so one firmware build serves
+ * every tank. They start from the Kconfig defaults and can be replaced by a config
+ * document received on the settings command topic; accepted documents are saved to
+ * NVS and survive reboots.
+ *
+ * A config document is a flat JSON object with integer values:
+ *
+ *   {"version":1,"reading_interval_sec":60,"tank_height_cm":120}
+ *
+ * "version" is required and must equal SETTINGS_VERSION. Other fields may be left
+ * out to keep their current value. An unknown field rejects the whole document, so
+ * a typo is reported instead of silently ignored.
+ *
+ * Readers get an immutable snapshot through settings_current(): a single atomic
+ * pointer load, with no NVS access and no lock, cheap enough for every reading.
+ * An update builds a new snapshot and swaps the pointer, so a reader always sees
+ * either the old settings or the new ones, never a mix of both.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "json_writer.h"
+
+#define SETTINGS_VERSION 1
+
+/* Snapshot slots that updates rotate through */
+#define SETTINGS_SNAPSHOTS 4
+
+typedef struct {
+    uint32_t reading_interval_sec;
+    uint32_t tank_height_cm;        // Sensor to tank bottom: the distance when empty
+} settings_t;
+
+/* Load saved settings from NVS, falling back to the Kconfig defaults.
+ * Call after nvs_flash_init(). */
+void settings_init(void);
+
+/* The settings in effect. The snapshot survives SETTINGS_SNAPSHOTS - 1 further
+ * updates before it is reused, so use it for one reading or one message and
+ * call again afterwards; never keep it across a blocking wait. */
+const settings_t *settings_current(void);
+
+/* Parse, validate, save and apply a config document. On failure nothing changes and
+ * reason holds a short human-readable explanation. */
+esp_err_t settings_apply_json(const char *data, size_t len, char *reason, size_t reason_len);
+
+/* Append settings as a config document that settings_apply_json() accepts */
+void settings_write_json(json_writer_t *w, const settings_t *settings);
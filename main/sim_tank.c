@@ -0,0 +1,56 @@
+/* Simulated salt tank (linux target) */
+
+#include <math.h>
+#include "hal.h"
+#include "sim_tank.h"
+
+/* Round trip of sound per centimetre of distance, in microseconds (343 m/s) */
+#define ECHO_US_PER_CM (2.0f / 0.0343f)
+
+void sim_tank_init(sim_tank_t *tank, uint32_t seed, float start_cm)
+{
+    // xorshift32 stays at 0 forever
+    tank->rng = seed != 0 ? seed : 1;
+    tank->start_cm = start_cm;
+}
+
+/* xorshift32: the same seed gives the same noise and dropouts on every run, so
+ * simulated runs are reproducible */
+static uint32_t next_random(sim_tank_t *tank)
+{
+    tank->rng ^= tank->rng << 13;
+    tank->rng ^= tank->rng >> 17;
+    tank->rng ^= tank->rng << 5;
+    return tank->rng;
+}
+
+/* Distance to the salt now: the level starts at start_cm and drops at
+ * CONFIG_SIM_DRAIN_MM_PER_HOUR, and the tank is refilled once empty */
+static float distance_cm(const sim_tank_t *tank, int64_t now_us, uint32_t tank_height_cm)
+{
+    float span = (float)tank_height_cm - tank->start_cm;
+    float drained = (float)now_us / 3600e6f * CONFIG_SIM_DRAIN_MM_PER_HOUR / 10.0f;
+
+    if (span <= 0.0f) {
+        return tank->start_cm;
+    }
+    return tank->start_cm + fmodf(drained, span);
+}
+
+int64_t sim_tank_echo_us(sim_tank_t *tank, int64_t now_us, uint32_t tank_height_cm)
+{
+#if CONFIG_SIM_NO_ECHO_PERMILLE > 0
+    if (next_random(tank) % 1000 < CONFIG_SIM_NO_ECHO_PERMILLE) {
+        return ECHO_NO_START;
+    }
+#endif
+
+    // Uniform noise of up to CONFIG_SIM_NOISE_MM either way
+    float noise_cm = 0.0f;
+#if CONFIG_SIM_NOISE_MM > 0
+    noise_cm = (float)((int32_t)(next_random(tank) % (2 * CONFIG_SIM_NOISE_MM + 1)) -
+                       CONFIG_SIM_NOISE_MM) / 10.0f;
+#endif
+
+    return (int64_t)((distance_cm(tank, now_us, tank_height_cm) + noise_cm) * ECHO_US_PER_CM);
+}
@@ -0,0 +1,22 @@
+/* Simulated salt tank (linux target)
+ *
+ * Produces the echo an HC-SR04 would return over a tank whose salt level drops at
+ * CONFIG_SIM_DRAIN_MM_PER_HOUR and is refilled once empty, with CONFIG_SIM_NOISE_MM
+ * of noise and CONFIG_SIM_NO_ECHO_PERMILLE missing echoes. Each tank has its own
+ * seeded generator, so the simulated sensor and every device of the virtual fleet
+ * draw independent but reproducible readings.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t rng;               // xorshift32 state, never 0
+    float start_cm;             // Distance to the salt when full and after a refill
+} sim_tank_t;
+
+void sim_tank_init(sim_tank_t *tank, uint32_t seed, float start_cm);
+
+/* Echo time at now_us (esp_timer time), or ECHO_NO_START for a missing echo */
+int64_t sim_tank_echo_us(sim_tank_t *tank, int64_t now_us, uint32_t tank_height_cm);
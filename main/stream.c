@@ -0,0 +1,203 @@
+/* Live sample stream over WebSocket */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "stream.h"
+
+static const char *TAG = "STREAM";
+
+#define SAMPLE_LEN     12
+#define NO_DISTANCE_MM 0xFFFF
+
+/* Samples waiting for the sender: a second's worth at the 20 Hz maximum */
+#define QUEUE_LEN      20
+
+static httpd_handle_t s_server = NULL;
+static TaskHandle_t s_sampler = NULL;
+static TaskHandle_t s_sender = NULL;
+
+/* Socket of the connected client, -1 when nobody is watching. Only one client is
+ * served; a new one takes over from the previous. */
+static volatile int s_client_fd = -1;
+
+/* Recent distances for the median filter, only touched by the sampling task.
+ * Restarted for every new client. */
+static int s_window_fd = -1;
+static uint16_t s_window[STREAM_FILTER_LEN];
+static size_t s_window_len = 0;
+static size_t s_window_pos = 0;
+
+/* Samples handed from the sampling task to the sender. When the sender falls
+ * behind the oldest sample is dropped: a live view wants the latest. */
+static portMUX_TYPE s_queue_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t s_queue[QUEUE_LEN][SAMPLE_LEN];
+static size_t s_queue_head = 0;
+static size_t s_queue_count = 0;
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, (uint16_t)v);
+    put_le16(p + 2, (uint16_t)(v >> 16));
+}
+
+/* Median of the window; insertion sort is plenty for five values */
+static uint16_t window_median(void)
+{
+    uint16_t sorted[STREAM_FILTER_LEN];
+
+    if (s_window_len == 0) {
+        return NO_DISTANCE_MM;
+    }
+    for (size_t i = 0; i < s_window_len; i++) {
+        uint16_t v = s_window[i];
+        size_t j = i;
+        while (j > 0 && sorted[j - 1] > v) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
+    }
+    return sorted[s_window_len / 2];
+}
+
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET) {
+        // Handshake done: this socket is now the stream client
+        s_client_fd = httpd_req_to_sockfd(req);
+        ESP_LOGI(TAG, "Client connected, sampling at %d Hz", CONFIG_SENSOR_STREAM_RATE_HZ);
+        if (s_sampler != NULL) {
+            xTaskNotifyGive(s_sampler);
+        }
+        return ESP_OK;
+    }
+
+    // Nothing is expected from the client; read and discard short frames, and
+    // drop the connection on anything bigger
+    httpd_ws_frame_t frame = { 0 };
+    uint8_t discard[16];
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if (err != ESP_OK || frame.len > sizeof(discard)) {
+        return ESP_FAIL;
+    }
+    frame.payload = discard;
+    return frame.len > 0 ? httpd_ws_recv_frame(req, &frame, frame.len) : ESP_OK;
+}
+
+void stream_init(TaskHandle_t sampler, TaskHandle_t sender)
+{
+    s_sampler = sampler;
+    s_sender = sender;
+}
+
+esp_err_t stream_register(httpd_handle_t server)
+{
+    const httpd_uri_t uri = {
+        .uri = "/stream",
+        .method = HTTP_GET,
+        .handler = stream_handler,
+        .is_websocket = true,
+    };
+
+    s_server = server;
+    return httpd_register_uri_handler(server, &uri);
+}
+
+void stream_session_closed(int sockfd)
+{
+    if (sockfd == s_client_fd) {
+        s_client_fd = -1;
+        ESP_LOGI(TAG, "Client disconnected, back to normal sampling");
+    }
+}
+
+bool stream_active(void)
+{
+    return s_client_fd >= 0;
+}
+
+void stream_push(int64_t echo_us, float distance_cm)
+{
+    uint8_t sample[SAMPLE_LEN];
+    int fd = s_client_fd;
+
+    if (fd < 0) {
+        return;
+    }
+    if (fd != s_window_fd) {
+        s_window_fd = fd;
+        s_window_len = 0;
+        s_window_pos = 0;
+    }
+
+    uint16_t distance_mm = NO_DISTANCE_MM;
+    if (distance_cm >= 0) {
+        distance_mm = (uint16_t)(distance_cm * 10.0f + 0.5f);
+        s_window[s_window_pos] = distance_mm;
+        s_window_pos = (s_window_pos + 1) % STREAM_FILTER_LEN;
+        if (s_window_len < STREAM_FILTER_LEN) {
+            s_window_len++;
+        }
+    }
+
+    put_le32(sample, (uint32_t)(esp_timer_get_time() / 1000));
+    put_le32(sample + 4, (uint32_t)(int32_t)echo_us);
+    put_le16(sample + 8, distance_mm);
+    put_le16(sample + 10, window_median());
+
+    taskENTER_CRITICAL(&s_queue_lock);
+    if (s_queue_count == QUEUE_LEN) {
+        s_queue_head = (s_queue_head + 1) % QUEUE_LEN;
+        s_queue_count--;
+    }
+    memcpy(s_queue[(s_queue_head + s_queue_count) % QUEUE_LEN], sample, SAMPLE_LEN);
+    s_queue_count++;
+    taskEXIT_CRITICAL(&s_queue_lock);
+
+    if (s_sender != NULL) {
+        xTaskNotifyGive(s_sender);
+    }
+}
+
+void stream_flush(void)
+{
+    static uint8_t sample[SAMPLE_LEN];
+
+    while (1) {
+        taskENTER_CRITICAL(&s_queue_lock);
+        bool have = s_queue_count > 0;
+        if (have) {
+            memcpy(sample, s_queue[s_queue_head], SAMPLE_LEN);
+            s_queue_head = (s_queue_head + 1) % QUEUE_LEN;
+            s_queue_count--;
+        }
+        taskEXIT_CRITICAL(&s_queue_lock);
+        if (!have) {
+            return;
+        }
+
+        // Samples queued for a client that has gone are dropped with the queue
+        int fd = s_client_fd;
+        if (fd < 0) {
+            continue;
+        }
+
+        httpd_ws_frame_t frame = {
+            .final = true,
+            .type = HTTPD_WS_TYPE_BINARY,
+            .payload = sample,
+            .len = sizeof(sample),
+        };
+        if (httpd_ws_send_frame_async(s_server, fd, &frame) != ESP_OK) {
+            // The close callback normally gets here first; stop either way
+            stream_session_closed(fd);
+        }
+    }
+}
@@ -0,0 +1,53 @@
+/* Live sample stream over WebSocket
+ *
+ * While a client is connected to ws://<device>/stream, the sensor task samples
+ * continuously at CONFIG_SENSOR_STREAM_RATE_HZ instead of once per reading
+ * interval, and every sample is sent as a binary frame. It is meant for mounting
+ * the sensor: watch the raw echo while moving it around the lid. Normal readings
+ * and publishing carry on unchanged, and the sampling rate drops back as soon as
+ * the client goes away.
+ *
+ * The sensor task only queues samples; the publish task sends them, so a slow
+ * client cannot hold up a reading.
+ *
+ * Each frame is one 12-byte little-endian sample:
+ *
+ *   uint32  time since boot in ms
+ *   int32   echo pulse width in us; -1 if no echo started, -2 if it never ended
+ *   uint16  distance in mm, or 0xFFFF when there was no usable echo
+ *   uint16  median of the last STREAM_FILTER_LEN distances in mm, or 0xFFFF
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define STREAM_FILTER_LEN 5
+
+#define STREAM_PERIOD_US (1000000 / CONFIG_SENSOR_STREAM_RATE_HZ)
+
+/* Set the task to notify when a client connects, so it can switch to the stream
+ * rate straight away, and the task to notify when samples are queued, which then
+ * calls stream_flush(). Call before stream_register(). */
+void stream_init(TaskHandle_t sampler, TaskHandle_t sender);
+
+/* Add the /stream WebSocket endpoint to a running server */
+esp_err_t stream_register(httpd_handle_t server);
+
+/* Forward from the server's close_fn: ends the stream if sockfd was its client */
+void stream_session_closed(int sockfd);
+
+/* A client is connected */
+bool stream_active(void);
+
+/* Queue one sample for the client, from the sampling task. distance_cm < 0 means
+ * no usable echo. */
+void stream_push(int64_t echo_us, float distance_cm);
+
+/* Send the queued samples, from the sender task */
+void stream_flush(void);
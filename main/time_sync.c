@@ -0,0 +1,93 @@
+/* Wall-clock time and SNTP synchronization */
+
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#if CONFIG_SNTP_ENABLE
+#include "esp_netif_sntp.h"
+#endif
+#include "time_sync.h"
+
+static const char *TAG = "TIME_SYNC";
+
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static time_sync_stats_t s_stats;
+
+/* Wall-clock and esp_timer time of the last sync, to tell how far the local clock
+ * has run since */
+static int64_t s_ref_wall_us = 0;
+static int64_t s_ref_timer_us = 0;
+
+int64_t time_sync_now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+bool time_sync_valid(void)
+{
+    return time_sync_timestamp_valid(time_sync_now_us());
+}
+
+int64_t time_sync_from_timer_us(int64_t timer_us)
+{
+    return time_sync_now_us() - (esp_timer_get_time() - timer_us);
+}
+
+void time_sync_get_stats(time_sync_stats_t *stats)
+{
+    taskENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    taskEXIT_CRITICAL(&s_lock);
+    stats->valid = time_sync_valid();
+}
+
+#if CONFIG_SNTP_ENABLE
+/* Runs in the lwIP task right after SNTP has set the system time to *tv */
+static void sync_cb(struct timeval *tv)
+{
+    int64_t now_timer_us = esp_timer_get_time();
+    int64_t server_us = (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+    taskENTER_CRITICAL(&s_lock);
+    if (s_ref_timer_us != 0) {
+        // Where the local clock would be had this sync not corrected it
+        int64_t elapsed_us = now_timer_us - s_ref_timer_us;
+        s_stats.offset_us = server_us - (s_ref_wall_us + elapsed_us);
+        if (s_stats.syncs > 0 && elapsed_us > 0) {
+            s_stats.drift_ppm = (float)s_stats.offset_us * 1e6f / (float)elapsed_us;
+            s_stats.have_drift = true;
+        }
+    }
+    s_stats.syncs++;
+    s_stats.last_sync_us = server_us;
+    s_ref_wall_us = server_us;
+    s_ref_timer_us = now_timer_us;
+    taskEXIT_CRITICAL(&s_lock);
+
+    ESP_LOGI(TAG, "Time synchronized, offset %lld us", s_stats.offset_us);
+}
+#endif
+
+void time_sync_start(void)
+{
+    if (time_sync_valid()) {
+        // Kept by the RTC from an earlier sync; the first sync measures its error
+        s_ref_wall_us = time_sync_now_us();
+        s_ref_timer_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Wall clock kept from before reset");
+    }
+
+#if CONFIG_SNTP_ENABLE
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_SNTP_SERVER);
+    config.sync_cb = sync_cb;
+    esp_err_t err = esp_netif_sntp_init(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start SNTP: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "SNTP started with %s", CONFIG_SNTP_SERVER);
+#endif
+}
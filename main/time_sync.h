@@ -0,0 +1,51 @@
+/* Wall-clock time and SNTP synchronization
+ *
+ * SNTP runs in the background, started alongside the MQTT connection rather than
+ * holding it up. The system time is kept by the RTC across deep sleep and software
+ * resets, so a clock set by an earlier sync is trusted straight away and SNTP only
+ * corrects it.
+ *
+ * Every sync compares the server's time with the local clock, giving the offset
+ * the sync corrected and, from the second sync on, the drift of the local clock
+ * in parts per million.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Earliest plausible wall-clock time (2025-01-01). A clock before this was never
+ * set and only counts time since boot. */
+#define TIME_SYNC_VALID_AFTER_US (1735689600LL * 1000000)
+
+typedef struct {
+    bool valid;                 // Wall clock is set, by SNTP or kept by the RTC
+    uint32_t syncs;             // SNTP syncs since boot
+    int64_t last_sync_us;       // Wall-clock time of the last sync, 0 before the first
+    int64_t offset_us;          // Server time minus local time at the last sync
+    float drift_ppm;            // Local clock rate error between the last two syncs
+    bool have_drift;
+} time_sync_stats_t;
+
+/* Start SNTP (CONFIG_SNTP_ENABLE). Call once the network interface exists. */
+void time_sync_start(void);
+
+/* Whether the wall clock holds a real date rather than time since boot */
+bool time_sync_valid(void);
+
+/* Whether a timestamp from this module was taken with the clock set. Unlike
+ * time_sync_valid() it still answers correctly once the clock has been set since,
+ * e.g. for a batched or queued reading. */
+static inline bool time_sync_timestamp_valid(int64_t timestamp_us)
+{
+    return timestamp_us >= TIME_SYNC_VALID_AFTER_US;
+}
+
+/* Current wall-clock time in microseconds since the epoch */
+int64_t time_sync_now_us(void);
+
+/* Convert an esp_timer_get_time() value from the recent past to wall-clock time */
+int64_t time_sync_from_timer_us(int64_t timer_us);
+
+void time_sync_get_stats(time_sync_stats_t *stats);
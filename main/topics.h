@@ -0,0 +1,33 @@
+/* MQTT topics
+ *
+ * Every topic only depends on CONFIG_MQTT_CLIENT_ID, so they are string literals
+ * assembled by the preprocessor and end up in rodata rather than being formatted
+ * at runtime.
+ */
+
+#pragma once
+
+#include "sdkconfig.h"
+
+/* Every device's topics live under TOPIC_BASE followed by its client ID */
+#define TOPIC_BASE              "homeassistant/sensor/"
+#define TOPIC_PREFIX            TOPIC_BASE CONFIG_MQTT_CLIENT_ID
+
+#define STATE_TOPIC             TOPIC_PREFIX "/state"
+#define STATE_CBOR_TOPIC        TOPIC_PREFIX "/state/cbor"
+#define BATCH_TOPIC             TOPIC_PREFIX "/batch"
+#define BATCH_CBOR_TOPIC        TOPIC_PREFIX "/batch/cbor"
+#define HISTORY_TOPIC           TOPIC_PREFIX "/history"
+#define CONNECTIVITY_TOPIC      TOPIC_PREFIX "/connectivity"
+#define DIAGNOSTICS_TOPIC       TOPIC_PREFIX "/diagnostics"
+#define BENCHMARK_TOPIC         TOPIC_PREFIX "/benchmark"
+#define AVAILABILITY_TOPIC      TOPIC_PREFIX "/availability"
+#define SETTINGS_TOPIC          TOPIC_PREFIX "/settings"
+#define SETTINGS_SET_TOPIC      TOPIC_PREFIX "/settings/set"
+
+/* Retained payloads of AVAILABILITY_TOPIC; "offline" is also the last will */
+#define AVAILABILITY_ONLINE     "online"
+#define AVAILABILITY_OFFLINE    "offline"
+
+#define DISTANCE_CONFIG_TOPIC   TOPIC_PREFIX "/distance/config"
+#define PERCENTAGE_CONFIG_TOPIC TOPIC_PREFIX "/percentage/config"